@@ -42,7 +42,11 @@
 #include <nlohmann/json.hpp>
 #include <vector>
 
+#include <diff.hh>
 #include <flutsch.hh>
+#include <position-index.hh>
+#include <search-index.hh>
+#include <shard.hh>
 
 using namespace nix;
 using namespace nlohmann;
@@ -105,6 +109,203 @@ struct CliArgs : MixEvalArgs, MixCommonArgs, RootArgs, flutsch::Config {
                      "print out a stack trace in case of evaluation errors",
                  .handler = {&showTrace, true}});
 
+        addFlag({.longName = "stack-size",
+                 .description = "stack size in MiB used to evaluate each "
+                                "top-level attribute in isolation (0 to "
+                                "disable)",
+                 .labels = {"mib"},
+                 .handler = {&stackSize}});
+
+        addFlag({.longName = "workers",
+                 .description = "number of threads introspecting top-level "
+                                "attributes, each with its own evaluator",
+                 .labels = {"n"},
+                 .handler = {&nrWorkers}});
+
+        addFlag({.longName = "checkpoint-dir",
+                 .description = "periodically write checkpoints to this "
+                                "directory",
+                 .labels = {"dir"},
+                 .handler = {&checkpointDir}});
+
+        addFlag({.longName = "checkpoint-interval",
+                 .description = "minimum seconds between two checkpoints",
+                 .labels = {"seconds"},
+                 .handler = {&checkpointInterval}});
+
+        addFlag({.longName = "resume",
+                 .description = "resume an interrupted run from the "
+                                "checkpoint in this directory",
+                 .labels = {"dir"},
+                 .handler = {&resumeDir}});
+
+        addFlag({.longName = "out",
+                 .shortName = 'o',
+                 .description = "file to write the results to",
+                 .labels = {"file"},
+                 .handler = {&outFile}});
+
+        addFlag({.longName = "compact",
+                 .description = "write the output without indentation",
+                 .handler = {&compact, true}});
+
+        addFlag({.longName = "sorted",
+                 .description = "write the records ordered by attribute path",
+                 .handler = {&sorted, true}});
+
+        addFlag({.longName = "search-index",
+                 .description = "write a search index for 'flutsch search' "
+                                "next to the output",
+                 .handler = {&searchIndex, true}});
+
+        addFlag({.longName = "position-index",
+                 .description = "write an index from source positions to "
+                                "attribute paths for 'flutsch lookup'",
+                 .handler = {&positionIndex, true}});
+
+        addFlag({.longName = "stats",
+                 .description = "write statistics about the run (counters, "
+                                "phase times, memory) next to the output",
+                 .handler = {&stats, true}});
+
+        addFlag({.longName = "progress",
+                 .description = "report nodes per second, frontier, errors "
+                                "and an ETA on stderr",
+                 .handler = {&progress, true}});
+
+        addFlag({.longName = "doc-comments",
+                 .description = "add the comment in front of every binding, "
+                                "lambda and formal to the output",
+                 .handler = {&docComments, true}});
+
+        addFlag({.longName = "shard",
+                 .description = "only introspect shard i of n, e.g. 2/4",
+                 .labels = {"i/n"},
+                 .handler = {[&](std::string shard) {
+                     std::smatch match;
+                     if (!std::regex_match(shard, match,
+                                           std::regex("([0-9]+)/([0-9]+)")))
+                         throw UsageError("invalid shard '%s'", shard);
+                     size_t index = std::stoul(match[1].str());
+                     shardCount = std::stoul(match[2].str());
+                     if (index < 1 || index > shardCount)
+                         throw UsageError("invalid shard '%s'", shard);
+                     shardIndex = index - 1;
+                 }}});
+
+        addFlag({.longName = "shard-depth",
+                 .description = "depth of the attributes that are split "
+                                "between shards (default: 1)",
+                 .labels = {"k"},
+                 .handler = {&shardDepth}});
+
+        addFlag({.longName = "dedupe-systems",
+                 .description = "skip definitions that are the same on the "
+                                "canonical system",
+                 .handler = {&dedupeSystems, true}});
+
+        addFlag({.longName = "canonical-system",
+                 .description = "system that is introspected fully with "
+                                "--dedupe-systems (default: current system)",
+                 .labels = {"system"},
+                 .handler = {&canonicalSystem}});
+
+        addFlag({.longName = "lists",
+                 .description = "introspect the elements of lists",
+                 .handler = {&traverseLists, true}});
+
+        addFlag({.longName = "sample-threshold",
+                 .description = "only introspect a sample of lists and "
+                                "attrsets with more elements than this",
+                 .labels = {"n"},
+                 .handler = {&sampleThreshold}});
+
+        addFlag({.longName = "sample-size",
+                 .description = "number of elements to introspect per "
+                                "sampled list or attrset (default: 32)",
+                 .labels = {"n"},
+                 .handler = {&sampleSize}});
+
+        addFlag({.longName = "static-lambdas",
+                 .description = "introspect nested lambdas from the syntax "
+                                "tree instead of calling them, where possible",
+                 .handler = {&staticLambdas, true}});
+
+        addFlag({.longName = "eval-cache",
+                 .description = "walk the flake through the evaluation cache "
+                                "of nix, only evaluate what is not cached",
+                 .handler = {&evalCache, true}});
+
+        addFlag({.longName = "eval-cache-depth",
+                 .description = "with --eval-cache, do not descend into "
+                                "attrsets deeper than this (default 8)",
+                 .labels = {"depth"},
+                 .handler = {&evalCacheDepth}});
+
+        addFlag({.longName = "error-table",
+                 .description = "write distinct errors to a separate table "
+                                "and refer to them by id",
+                 .handler = {&errorTable, true}});
+
+        addFlag({.longName = "shapes",
+                 .description = "write distinct attrset shapes to a separate "
+                                "table and refer to them by id",
+                 .handler = {&shapes, true}});
+
+        addFlag({.longName = "low-memory",
+                 .description = "release finished values right after they "
+                                "are written",
+                 .handler = {&lowMemory, true}});
+
+        addFlag({.longName = "format",
+                 .description = "output format: json or ndjson",
+                 .labels = {"format"},
+                 .handler = {&format}});
+
+        addFlag({.longName = "zstd",
+                 .description = "compress the output with zstd",
+                 .handler = {&zstd, true}});
+
+        addFlag({.longName = "zstd-level",
+                 .description = "zstd compression level",
+                 .labels = {"level"},
+                 .handler = {&zstdLevel}});
+
+        addFlag({.longName = "zstd-threads",
+                 .description = "zstd worker threads (default: free cores)",
+                 .labels = {"n"},
+                 .handler = {&zstdThreads}});
+
+        addFlag({.longName = "track-deps",
+                 .description = "record the files each top-level attribute "
+                                "depends on",
+                 .handler = {&trackDependencies, true}});
+
+        addFlag({.longName = "incremental",
+                 .description = "only re-analyze attributes of a previous "
+                                "output whose dependencies changed",
+                 .labels = {"file"},
+                 .handler = {&previousOutput}});
+
+        addFlag({.longName = "changed",
+                 .description = "a file changed since the previous run "
+                                "(default: detect changes)",
+                 .labels = {"file"},
+                 .handler = {[&](std::string file) {
+                     changedFiles.push_back(
+                         std::filesystem::absolute(file).string());
+                 }}});
+
+        addFlag({.longName = "watch",
+                 .description = "keep running and update the output when a "
+                                "source file changes",
+                 .handler = {&watch, true}});
+
+        addFlag({.longName = "batch",
+                 .description = "read jobs as JSON lines from stdin, e.g. "
+                                "{\"expr\": \"./a.nix\", \"out\": \"a.json\"}",
+                 .handler = {&batch, true}});
+
         addFlag({.longName = "expr",
                  .shortName = 'E',
                  .description = "treat the argument as a Nix expression",
@@ -126,9 +327,99 @@ struct CliArgs : MixEvalArgs, MixCommonArgs, RootArgs, flutsch::Config {
             }},
         });
 
-        expectArg("expr", &releaseExpr);
+        // Not needed with --batch
+        expectArg("expr", &releaseExpr, true);
     }
 };
+
+// flutsch merge [options] inputs...
+struct MergeArgs : MixCommonArgs, flutsch::Config {
+    std::vector<std::string> inputs;
+
+    MergeArgs() : MixCommonArgs("flutsch merge") {
+        addFlag({.longName = "out",
+                 .shortName = 'o',
+                 .description = "file to write the merged results to",
+                 .labels = {"file"},
+                 .handler = {&outFile}});
+
+        addFlag({.longName = "compact",
+                 .description = "write the output without indentation",
+                 .handler = {&compact, true}});
+
+        addFlag({.longName = "format",
+                 .description = "output format: json or ndjson",
+                 .labels = {"format"},
+                 .handler = {&format}});
+
+        addFlag({.longName = "zstd",
+                 .description = "compress the output with zstd",
+                 .handler = {&zstd, true}});
+
+        expectArgs("inputs", &inputs);
+    }
+};
+
+// flutsch search [options] query
+struct SearchArgs : MixCommonArgs {
+    std::string index = "values.search.idx";
+    size_t limit = 20;
+    std::string query;
+
+    SearchArgs() : MixCommonArgs("flutsch search") {
+        addFlag({.longName = "index",
+                 .description = "search index written with --search-index",
+                 .labels = {"file"},
+                 .handler = {&index}});
+
+        addFlag({.longName = "limit",
+                 .description = "maximum number of results",
+                 .labels = {"n"},
+                 .handler = {&limit}});
+
+        expectArg("query", &query);
+    }
+};
+
+// flutsch lookup [options] file:line[:column]
+struct LookupArgs : MixCommonArgs {
+    std::string index = "values.positions.idx";
+    std::string position;
+
+    LookupArgs() : MixCommonArgs("flutsch lookup") {
+        addFlag({.longName = "index",
+                 .description = "position index written with "
+                                "--position-index",
+                 .labels = {"file"},
+                 .handler = {&index}});
+
+        expectArg("position", &position);
+    }
+};
+
+// flutsch diff [options] old new
+struct DiffArgs : MixCommonArgs, flutsch::Config {
+    std::string oldOutput;
+    std::string newOutput;
+
+    DiffArgs() : MixCommonArgs("flutsch diff") {
+        outFile = "diff.ndjson";
+
+        addFlag({.longName = "out",
+                 .shortName = 'o',
+                 .description = "file to write the changes to, one per line",
+                 .labels = {"file"},
+                 .handler = {&outFile}});
+
+        addFlag({.longName = "zstd",
+                 .description = "compress the output with zstd",
+                 .handler = {&zstd, true}});
+
+        expectArg("old", &oldOutput);
+        expectArg("new", &newOutput);
+    }
+};
+
 #ifdef __GNUC__
 #pragma GCC diagnostic ignored "-Wnon-virtual-dtor"
 #elif __clang__
@@ -137,6 +428,73 @@ struct CliArgs : MixEvalArgs, MixCommonArgs, RootArgs, flutsch::Config {
 
 static CliArgs cliArgs;
 
+static void runMerge(const Strings &args) {
+    MergeArgs mergeArgs;
+    mergeArgs.parseCmdline(args);
+    if (mergeArgs.inputs.empty())
+        throw UsageError("no inputs to merge specified");
+    if (mergeArgs.format != "json" && mergeArgs.format != "ndjson")
+        throw UsageError("unknown output format '%s'", mergeArgs.format);
+    flutsch::mergeOutputs(mergeArgs.inputs, mergeArgs);
+}
+
+static void runSearch(const Strings &args) {
+    SearchArgs searchArgs;
+    searchArgs.parseCmdline(args);
+    flutsch::SearchIndex index(searchArgs.index);
+    for (auto &hit : index.find(searchArgs.query, searchArgs.limit)) {
+        if (hit.formal) {
+            std::cout << hit.path << " { " << hit.name << " }" << std::endl;
+        } else {
+            std::cout << hit.path << std::endl;
+        }
+    }
+}
+
+static void runLookup(const Strings &args) {
+    LookupArgs lookupArgs;
+    lookupArgs.parseCmdline(args);
+
+    // file:line or file:line:column, the file may contain colons itself.
+    std::string file = lookupArgs.position;
+    std::vector<uint32_t> numbers;
+    for (size_t n = 0; n < 2; n++) {
+        auto colon = file.rfind(':');
+        auto tail = colon == std::string::npos ? "" : file.substr(colon + 1);
+        if (tail.empty() ||
+            tail.find_first_not_of("0123456789") != std::string::npos)
+            break;
+        numbers.insert(numbers.begin(), std::stoul(tail));
+        file = file.substr(0, colon);
+    }
+    if (numbers.empty())
+        throw UsageError("expected file:line[:column], got '%s'",
+                         lookupArgs.position);
+    file = std::filesystem::absolute(file).lexically_normal().string();
+
+    flutsch::PositionIndex index(lookupArgs.index);
+    auto hits =
+        index.at(file, numbers[0], numbers.size() > 1 ? numbers[1] : 0);
+    for (auto &hit : hits) {
+        std::cout << hit.line << ":" << hit.column << " " << hit.kind << " "
+                  << hit.path;
+        if (hit.kind == "formal") {
+            std::cout << " { " << hit.name << " }";
+        }
+        std::cout << std::endl;
+    }
+}
+
+static void runDiff(const Strings &args) {
+    DiffArgs diffArgs;
+    diffArgs.parseCmdline(args);
+    auto summary =
+        flutsch::diffOutputs(diffArgs.oldOutput, diffArgs.newOutput, diffArgs);
+    std::cout << summary.added << " added, " << summary.removed
+              << " removed, " << summary.changed
+              << " changed. Written to: " << diffArgs.outFile << std::endl;
+}
+
 int main(int argc, char **argv) {
     return handleExceptions(argv[0], [&]() {
         initNix();
@@ -158,11 +516,79 @@ int main(int argc, char **argv) {
             evalSettings.pureEval = true;
         }
 
-        cliArgs.parseCmdline(argvToStrings(argc, argv));
+        auto args = argvToStrings(argc, argv);
+        if (!args.empty() && args.front() == "merge") {
+            args.pop_front();
+            runMerge(args);
+            return;
+        }
+        if (!args.empty() && args.front() == "diff") {
+            args.pop_front();
+            runDiff(args);
+            return;
+        }
+        if (!args.empty() && args.front() == "search") {
+            args.pop_front();
+            runSearch(args);
+            return;
+        }
+        if (!args.empty() && args.front() == "lookup") {
+            args.pop_front();
+            runLookup(args);
+            return;
+        }
+        cliArgs.parseCmdline(args);
 
-        if (cliArgs.releaseExpr == "")
+        if (cliArgs.releaseExpr == "" && !cliArgs.batch)
             throw UsageError("no expression specified");
 
+        if (cliArgs.batch &&
+            (cliArgs.watch || cliArgs.resumeDir || cliArgs.checkpointDir ||
+             cliArgs.previousOutput || cliArgs.evalCache))
+            throw UsageError("--batch cannot be combined with --watch, "
+                             "--resume, --checkpoint-dir, --incremental or "
+                             "--eval-cache");
+
+        if (cliArgs.nrWorkers == 0)
+            throw UsageError("--workers must be at least 1");
+
+        // Every worker has its own tables and checkpoints would need to
+        // know about all of them.
+        if (cliArgs.nrWorkers > 1 &&
+            (cliArgs.batch || cliArgs.watch || cliArgs.evalCache ||
+             cliArgs.resumeDir || cliArgs.checkpointDir ||
+             cliArgs.previousOutput || cliArgs.trackDependencies ||
+             cliArgs.shapes || cliArgs.errorTable || cliArgs.dedupeSystems))
+            throw UsageError(
+                "--workers cannot be combined with --batch, --watch, "
+                "--eval-cache, --resume, --checkpoint-dir, --incremental, "
+                "--track-deps, --shapes, --error-table or --dedupe-systems");
+
+        // Both hold every record until the end of the run.
+        if (cliArgs.lowMemory && (cliArgs.sorted || cliArgs.nrWorkers > 1))
+            throw UsageError(
+                "--low-memory cannot be combined with --sorted or --workers");
+
+        if (cliArgs.format != "json" && cliArgs.format != "ndjson")
+            throw UsageError("unknown output format '%s'", cliArgs.format);
+
+        // The cached traversal does not implement these.
+        if (cliArgs.evalCache &&
+            (!cliArgs.flake || cliArgs.previousOutput || cliArgs.resumeDir ||
+             cliArgs.checkpointDir || cliArgs.watch ||
+             cliArgs.trackDependencies || cliArgs.traverseLists ||
+             cliArgs.shapes || cliArgs.errorTable || cliArgs.sorted))
+            throw UsageError("--eval-cache requires --flake and cannot be "
+                             "combined with --incremental, --resume, "
+                             "--checkpoint-dir, --watch, --track-deps, "
+                             "--lists, --shapes, --error-table or --sorted");
+
+        // Ids of carried over records refer to other tables.
+        if ((cliArgs.shapes || cliArgs.errorTable) &&
+            (cliArgs.previousOutput || cliArgs.resumeDir || cliArgs.watch))
+            throw UsageError("--shapes and --error-table cannot be combined "
+                             "with --incremental, --resume or --watch");
+
         json config({});
         if (cliArgs.config.has_value()) {
             std::cout << cliArgs.config.value() << std::endl;
@@ -193,6 +619,41 @@ int main(int argc, char **argv) {
             cliArgs.flake, cliArgs.fromArgs, cliArgs.showTrace, cliArgs.impure,
             cliArgs.checkCacheStatus, cliArgs.nrWorkers, cliArgs.maxMemorySize,
             cliArgs.lockFlags};
+        flutsch_conf.stackSize = cliArgs.stackSize;
+        flutsch_conf.checkpointDir = cliArgs.checkpointDir;
+        flutsch_conf.checkpointInterval = cliArgs.checkpointInterval;
+        flutsch_conf.resumeDir = cliArgs.resumeDir;
+        flutsch_conf.outFile = cliArgs.outFile;
+        flutsch_conf.compact = cliArgs.compact;
+        flutsch_conf.docComments = cliArgs.docComments;
+        flutsch_conf.sorted = cliArgs.sorted;
+        flutsch_conf.searchIndex = cliArgs.searchIndex;
+        flutsch_conf.positionIndex = cliArgs.positionIndex;
+        flutsch_conf.stats = cliArgs.stats;
+        flutsch_conf.progress = cliArgs.progress;
+        flutsch_conf.lowMemory = cliArgs.lowMemory;
+        flutsch_conf.shapes = cliArgs.shapes;
+        flutsch_conf.errorTable = cliArgs.errorTable;
+        flutsch_conf.evalCache = cliArgs.evalCache;
+        flutsch_conf.evalCacheDepth = cliArgs.evalCacheDepth;
+        flutsch_conf.staticLambdas = cliArgs.staticLambdas;
+        flutsch_conf.traverseLists = cliArgs.traverseLists;
+        flutsch_conf.shardIndex = cliArgs.shardIndex;
+        flutsch_conf.shardCount = cliArgs.shardCount;
+        flutsch_conf.shardDepth = cliArgs.shardDepth;
+        flutsch_conf.dedupeSystems = cliArgs.dedupeSystems;
+        flutsch_conf.canonicalSystem = cliArgs.canonicalSystem;
+        flutsch_conf.sampleThreshold = cliArgs.sampleThreshold;
+        flutsch_conf.sampleSize = cliArgs.sampleSize;
+        flutsch_conf.format = cliArgs.format;
+        flutsch_conf.zstd = cliArgs.zstd;
+        flutsch_conf.zstdLevel = cliArgs.zstdLevel;
+        flutsch_conf.zstdThreads = cliArgs.zstdThreads;
+        flutsch_conf.trackDependencies = cliArgs.trackDependencies;
+        flutsch_conf.previousOutput = cliArgs.previousOutput;
+        flutsch_conf.changedFiles = cliArgs.changedFiles;
+        flutsch_conf.watch = cliArgs.watch;
+        flutsch_conf.batch = cliArgs.batch;
         std::cout << "rootDir" << cliArgs.gcRootsDir << std::endl;
 
         flutsch::getPositions(cliArgs, flutsch_conf);
@@ -11,6 +11,7 @@
 , nix
 , nlohmann_json
 , catch2_3
+, zstd
 , pkg-config
 }:
 
@@ -30,6 +31,7 @@ stdenv.mkDerivation {
     nlohmann_json
     nix
     boost
+    zstd
   ];
   nativeBuildInputs = [
     makeWrapper
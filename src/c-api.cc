@@ -0,0 +1,119 @@
+#include <nix/common-eval-args.hh>
+#include <nix/globals.hh>
+#include <nix/shared.hh>
+
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "flutsch-c.h"
+#include "flutsch.hh"
+#include "isolate.hh"
+#include "result-buffer.hh"
+
+// Safe to ignore - the args will be static.
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wnon-virtual-dtor"
+#elif __clang__
+#pragma clang diagnostic ignored "-Wnon-virtual-dtor"
+#endif
+
+struct CApiArgs : nix::MixEvalArgs {};
+
+struct flutsch_analyzer {
+    CApiArgs args;
+    flutsch::Config config;
+    std::string buffer;
+    std::optional<std::string> error;
+};
+
+static std::once_flag initOnce;
+
+extern "C" {
+
+flutsch_analyzer *flutsch_analyzer_new(const char *expr, int is_flake) {
+    if (expr == nullptr) {
+        return nullptr;
+    }
+    // Nothing may propagate into C.
+    try {
+        auto *analyzer = new flutsch_analyzer{{}, flutsch::Config{{}, expr}};
+        analyzer->config.flake = is_flake != 0;
+        analyzer->args.evalStoreUrl = nix::settings.storeUri.get();
+        return analyzer;
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void flutsch_analyzer_free(flutsch_analyzer *analyzer) { delete analyzer; }
+
+int flutsch_analyzer_run(flutsch_analyzer *analyzer) {
+    try {
+        std::call_once(initOnce, []() {
+            nix::initNix();
+            nix::initGC();
+            flutsch::allowGcThreads();
+        });
+        analyzer->buffer.clear();
+        // The caller's thread is neither known to the garbage collector nor
+        // guaranteed to have a large stack. A stackSize of 0 only disables
+        // the isolation in the CLI, here it still needs a thread.
+        size_t stackSize = analyzer->config.stackSize != 0
+                               ? analyzer->config.stackSize
+                               : flutsch::Config{{}, ""}.stackSize;
+        auto result = flutsch::runOnLargeStack(stackSize * 1024 * 1024, [&]() {
+            flutsch::Analyzer a(analyzer->args, analyzer->config);
+            a.init_root_value();
+            analyzer->buffer = flutsch::buildResultBuffer(a);
+        });
+        if (result == flutsch::IsolationResult::StackOverflow) {
+            analyzer->error = "stack overflow (possible infinite recursion)";
+            return 1;
+        }
+        analyzer->error.reset();
+        return 0;
+    } catch (std::exception &e) {
+        analyzer->buffer.clear();
+        analyzer->error = e.what();
+        return 1;
+    } catch (...) {
+        analyzer->buffer.clear();
+        analyzer->error = "unknown error";
+        return 1;
+    }
+}
+
+const char *flutsch_analyzer_error(const flutsch_analyzer *analyzer) {
+    return analyzer->error ? analyzer->error->c_str() : nullptr;
+}
+
+const void *flutsch_analyzer_buffer(const flutsch_analyzer *analyzer,
+                                    size_t *size) {
+    if (size != nullptr) {
+        *size = analyzer->buffer.size();
+    }
+    return analyzer->buffer.empty() ? nullptr : analyzer->buffer.data();
+}
+
+uint32_t flutsch_node_count(const void *buffer) {
+    return static_cast<const flutsch_buffer_header *>(buffer)->node_count;
+}
+
+const flutsch_node *flutsch_node_at(const void *buffer, uint32_t index) {
+    auto *header = static_cast<const flutsch_buffer_header *>(buffer);
+    auto *base = static_cast<const char *>(buffer);
+    return reinterpret_cast<const flutsch_node *>(base +
+                                                  header->nodes_offset) +
+           index;
+}
+
+const char *flutsch_string(const void *buffer, uint32_t offset) {
+    if (offset == FLUTSCH_NONE) {
+        return nullptr;
+    }
+    auto *header = static_cast<const flutsch_buffer_header *>(buffer);
+    return static_cast<const char *>(buffer) + header->strings_offset + offset;
+}
+
+} // extern "C"
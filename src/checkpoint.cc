@@ -0,0 +1,179 @@
+#include <nix/error.hh>
+
+#include <cerrno>
+#include <fstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "checkpoint.hh"
+
+using namespace nlohmann;
+
+namespace flutsch {
+
+static const int checkpointVersion = 2;
+
+// Records are buffered up to this size before they are written.
+static const size_t bufferSize = 1 << 16;
+
+static std::filesystem::path checkpointFile(const std::filesystem::path &dir) {
+    return dir / "checkpoint.json";
+}
+
+static std::string recordsFileName(uint64_t generation) {
+    return "records-" + std::to_string(generation) + ".ndjson";
+}
+
+static void writeAll(int fd, std::string_view data,
+                     const std::filesystem::path &path) {
+    while (!data.empty()) {
+        ssize_t n = ::write(fd, data.data(), data.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw nix::SysError("writing checkpoint file '%s'", path.string());
+        }
+        data.remove_prefix(n);
+    }
+}
+
+static void syncFile(int fd, const std::filesystem::path &path) {
+    if (fsync(fd) != 0) {
+        throw nix::SysError("syncing checkpoint file '%s'", path.string());
+    }
+}
+
+// The state of the checkpoint in 'dir', if there is one.
+static std::optional<json> readState(const std::filesystem::path &dir) {
+    std::ifstream file(checkpointFile(dir));
+    if (!file.is_open()) {
+        return {};
+    }
+    json j = json::parse(file);
+    if (j.value("version", 0) != checkpointVersion) {
+        throw nix::Error("unsupported checkpoint version in '%s'",
+                         checkpointFile(dir).string());
+    }
+    return j;
+}
+
+CheckpointWriter::CheckpointWriter(const std::string &dir,
+                                   const Checkpoint &base)
+    : dir(dir), releaseExpr(base.releaseExpr) {
+    std::filesystem::create_directories(dir);
+    // A new generation, so that the committed checkpoint stays intact until
+    // the first commit of this one.
+    if (auto state = readState(dir)) {
+        generation = state->at("generation").get<uint64_t>() + 1;
+    }
+    auto path = this->dir / recordsFileName(generation);
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw nix::SysError("opening checkpoint file '%s'", path.string());
+    }
+    for (auto &record : base.records) {
+        add(record.dump());
+    }
+    commit(base.done);
+
+    // Earlier generations are not referenced anymore.
+    for (auto &entry : std::filesystem::directory_iterator(dir)) {
+        auto name = entry.path().filename().string();
+        if (name.starts_with("records-") &&
+            name != recordsFileName(generation)) {
+            std::filesystem::remove(entry.path());
+        }
+    }
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void CheckpointWriter::add(std::string_view record) {
+    buffer.append(record);
+    buffer.push_back('\n');
+    size += record.size() + 1;
+    if (buffer.size() >= bufferSize) {
+        flush();
+    }
+}
+
+void CheckpointWriter::flush() {
+    writeAll(fd, buffer, dir / recordsFileName(generation));
+    buffer.clear();
+}
+
+void CheckpointWriter::commit(const std::set<std::string> &done) {
+    flush();
+    syncFile(fd, dir / recordsFileName(generation));
+
+    json j = json::object({{"version", checkpointVersion},
+                           {"expr", releaseExpr},
+                           {"done", done},
+                           {"generation", generation},
+                           {"records", recordsFileName(generation)},
+                           {"size", size}});
+
+    // Write to a temporary file first. A kill during the write must never
+    // leave a truncated checkpoint behind.
+    auto target = checkpointFile(dir);
+    auto tmp = target;
+    tmp += ".tmp";
+    int tmpFd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     0644);
+    if (tmpFd < 0) {
+        throw nix::SysError("opening checkpoint file '%s'", tmp.string());
+    }
+    try {
+        writeAll(tmpFd, j.dump(), tmp);
+        syncFile(tmpFd, tmp);
+    } catch (...) {
+        close(tmpFd);
+        throw;
+    }
+    close(tmpFd);
+    std::filesystem::rename(tmp, target);
+
+    // Make the rename itself durable.
+    int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+}
+
+std::optional<Checkpoint> readCheckpoint(const std::string &dir) {
+    auto state = readState(dir);
+    if (!state) {
+        return {};
+    }
+
+    Checkpoint checkpoint;
+    checkpoint.releaseExpr = state->at("expr").get<std::string>();
+    checkpoint.done = state->at("done").get<std::set<std::string>>();
+
+    auto path = std::filesystem::path(dir) /
+                state->at("records").get<std::string>();
+    auto size = state->at("size").get<uint64_t>();
+    std::ifstream file(path, std::ios::binary);
+    std::string committed(size, '\0');
+    if (!file.read(committed.data(), size)) {
+        throw nix::Error("checkpoint records '%s' are truncated",
+                         path.string());
+    }
+    size_t start = 0;
+    while (start < committed.size()) {
+        size_t end = committed.find('\n', start);
+        checkpoint.records.push_back(
+            json::parse(committed.substr(start, end - start)));
+        start = end + 1;
+    }
+    return checkpoint;
+}
+
+}; // namespace flutsch
@@ -0,0 +1,201 @@
+#include <nix/error.hh>
+
+#include <fstream>
+#include <vector>
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compression.hh"
+
+namespace flutsch {
+
+#if HAVE_ZSTD
+
+bool haveZstd() { return true; }
+
+static void checkZstd(size_t rc, const char *what) {
+    if (ZSTD_isError(rc)) {
+        throw nix::Error("%s: %s", what, ZSTD_getErrorName(rc));
+    }
+}
+
+ZstdSink::ZstdSink(std::unique_ptr<OutputSink> inner, int level, int threads)
+    : inner(std::move(inner)) {
+    auto *ctx = ZSTD_createCCtx();
+    if (ctx == nullptr) {
+        throw nix::Error("cannot create zstd compression context");
+    }
+    cctx = ctx;
+    checkZstd(ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, level),
+              "setting zstd compression level");
+    if (threads > 0) {
+        // Fails if libzstd was built without multithreading. Compressing on
+        // the writer thread still works then.
+        ZSTD_CCtx_setParameter(ctx, ZSTD_c_nbWorkers, threads);
+    }
+    outBuf.resize(ZSTD_CStreamOutSize());
+}
+
+ZstdSink::~ZstdSink() { ZSTD_freeCCtx(static_cast<ZSTD_CCtx *>(cctx)); }
+
+void ZstdSink::write(const char *data, size_t len) {
+    auto *ctx = static_cast<ZSTD_CCtx *>(cctx);
+    ZSTD_inBuffer in = {data, len, 0};
+    while (in.pos < in.size) {
+        ZSTD_outBuffer out = {outBuf.data(), outBuf.size(), 0};
+        checkZstd(ZSTD_compressStream2(ctx, &out, &in, ZSTD_e_continue),
+                  "compressing output");
+        inner->write(outBuf.data(), out.pos);
+    }
+}
+
+void ZstdSink::finish() {
+    auto *ctx = static_cast<ZSTD_CCtx *>(cctx);
+    ZSTD_inBuffer in = {nullptr, 0, 0};
+    size_t remaining;
+    do {
+        ZSTD_outBuffer out = {outBuf.data(), outBuf.size(), 0};
+        remaining = ZSTD_compressStream2(ctx, &out, &in, ZSTD_e_end);
+        checkZstd(remaining, "finishing compressed output");
+        inner->write(outBuf.data(), out.pos);
+    } while (remaining != 0);
+    inner->finish();
+}
+
+namespace {
+
+class ZstdSource : public InputSource {
+  public:
+    ZstdSource(const std::string &path, std::unique_ptr<InputSource> inner)
+        : path(path), inner(std::move(inner)) {
+        dctx = ZSTD_createDStream();
+        if (dctx == nullptr) {
+            throw nix::Error("cannot create zstd decompression context");
+        }
+        inBuf.resize(ZSTD_DStreamInSize());
+    }
+
+    ~ZstdSource() override { ZSTD_freeDStream(dctx); }
+
+    size_t read(char *data, size_t len) override {
+        while (true) {
+            if (in.pos == in.size && !inputDone) {
+                size_t n = inner->read(inBuf.data(), inBuf.size());
+                in = {inBuf.data(), n, 0};
+                inputDone = n == 0;
+            }
+            ZSTD_outBuffer out = {data, len, 0};
+            size_t consumed = in.pos;
+            size_t rc = ZSTD_decompressStream(dctx, &out, &in);
+            if (ZSTD_isError(rc)) {
+                throw nix::Error("decompressing '%s': %s", path,
+                                 ZSTD_getErrorName(rc));
+            }
+            // A call without any input or output after the end of a frame
+            // asks for the next frame header, that is not truncation.
+            if (in.pos != consumed || out.pos > 0) {
+                frameDone = rc == 0;
+            }
+            if (out.pos > 0) {
+                return out.pos;
+            }
+            if (inputDone) {
+                if (!frameDone) {
+                    throw nix::Error("'%s' is truncated", path);
+                }
+                return 0;
+            }
+        }
+    }
+
+  private:
+    std::string path;
+    std::unique_ptr<InputSource> inner;
+    ZSTD_DStream *dctx;
+    std::vector<char> inBuf;
+    ZSTD_inBuffer in = {nullptr, 0, 0};
+    bool inputDone = false;
+    // Whether the last frame was decompressed completely.
+    bool frameDone = true;
+};
+
+} // namespace
+
+static std::unique_ptr<InputSource>
+decompressing(const std::string &path, std::unique_ptr<InputSource> inner) {
+    return std::make_unique<ZstdSource>(path, std::move(inner));
+}
+
+#else
+
+bool haveZstd() { return false; }
+
+ZstdSink::ZstdSink(std::unique_ptr<OutputSink> inner, int, int)
+    : inner(std::move(inner)) {
+    throw nix::Error("flutsch was built without zstd support");
+}
+
+ZstdSink::~ZstdSink() {}
+
+void ZstdSink::write(const char *, size_t) {}
+
+void ZstdSink::finish() {}
+
+static std::unique_ptr<InputSource>
+decompressing(const std::string &path, std::unique_ptr<InputSource>) {
+    throw nix::Error("cannot read '%s': flutsch was built without zstd support",
+                     path);
+}
+
+#endif
+
+static bool isZstd(const std::string &data) {
+    // Little endian magic number 0xFD2FB528
+    return data.size() >= 4 && static_cast<unsigned char>(data[0]) == 0x28 &&
+           static_cast<unsigned char>(data[1]) == 0xb5 &&
+           static_cast<unsigned char>(data[2]) == 0x2f &&
+           static_cast<unsigned char>(data[3]) == 0xfd;
+}
+
+namespace {
+
+class FileSource : public InputSource {
+  public:
+    explicit FileSource(const std::string &path)
+        : file(path, std::ios::binary) {
+        if (!file.is_open()) {
+            throw nix::Error("cannot open '%s'", path);
+        }
+    }
+
+    size_t read(char *data, size_t len) override {
+        file.read(data, len);
+        return file.gcount();
+    }
+
+  private:
+    std::ifstream file;
+};
+
+} // namespace
+
+std::unique_ptr<InputSource> openInput(const std::string &path) {
+    std::string magic(4, '\0');
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            throw nix::Error("cannot open '%s'", path);
+        }
+        file.read(magic.data(), magic.size());
+        magic.resize(file.gcount());
+    }
+    std::unique_ptr<InputSource> source = std::make_unique<FileSource>(path);
+    if (isZstd(magic)) {
+        return decompressing(path, std::move(source));
+    }
+    return source;
+}
+
+}; // namespace flutsch
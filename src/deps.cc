@@ -0,0 +1,172 @@
+#include <nix/eval.hh>
+#include <nix/eval-inline.hh>
+#include <nix/error.hh>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include <nlohmann/json.hpp>
+
+#include "deps.hh"
+
+using namespace nix;
+using namespace nlohmann;
+
+namespace flutsch {
+
+// Version 2 added the introspection order.
+static const int dependencyVersion = 2;
+
+static thread_local std::set<std::string> *currentScope = nullptr;
+
+DependencyScope::DependencyScope(std::set<std::string> &files)
+    : previous(currentScope) {
+    currentScope = &files;
+}
+
+DependencyScope::~DependencyScope() { currentScope = previous; }
+
+void addDependency(const std::string &file) {
+    if (currentScope != nullptr) {
+        currentScope->insert(file);
+    }
+}
+
+// The 'import' primop of nix, before we wrapped it.
+static PrimOpFun originalImport;
+
+static void prim_trackedImport(EvalState &state, const PosIdx pos,
+                               Value **args, Value &v) {
+    if (currentScope != nullptr) {
+        try {
+            NixStringContext context;
+            auto path = state.coerceToPath(pos, *args[0], context,
+                                           "while tracking an import");
+            std::string file = path.path.abs();
+            // 'import ./dir' evaluates './dir/default.nix'
+            if (std::filesystem::is_directory(file)) {
+                file += "/default.nix";
+            }
+            addDependency(file);
+        } catch (nix::Error &e) {
+            // Let the real import report the error.
+        }
+    }
+    originalImport(state, pos, args, v);
+}
+
+void trackImports(EvalState &state) {
+    // 'import' and 'builtins.import' share the same value.
+    Value *builtins = state.baseEnv.values[0];
+    Attr *import = builtins->attrs->get(state.symbols.create("import"));
+    if (import == nullptr || !import->value->isPrimOp()) {
+        throw Error("cannot track imports: 'builtins.import' is not a primop");
+    }
+
+    auto wrapped = new PrimOp(*import->value->primOp);
+    originalImport = wrapped->fun;
+    wrapped->fun = prim_trackedImport;
+    import->value->mkPrimOp(wrapped);
+}
+
+std::string fileFingerprint(const std::string &file) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in.is_open()) {
+        return "";
+    }
+
+    // 64 bit FNV-1a. Only used to detect changes, not for security.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t size = 0;
+    char buf[64 * 1024];
+    while (in.read(buf, sizeof(buf)) || in.gcount() > 0) {
+        for (std::streamsize i = 0; i < in.gcount(); i++) {
+            hash ^= static_cast<unsigned char>(buf[i]);
+            hash *= 0x100000001b3ULL;
+        }
+        size += in.gcount();
+    }
+
+    std::ostringstream oss;
+    oss << size << ":" << std::hex << hash;
+    return oss.str();
+}
+
+std::set<std::string> changedFiles(const DependencyInfo &info) {
+    std::set<std::string> changed;
+    for (auto &[file, fingerprint] : info.fingerprints) {
+        if (fileFingerprint(file) != fingerprint) {
+            changed.insert(file);
+        }
+    }
+    return changed;
+}
+
+std::set<std::string> reusableAttrs(const DependencyInfo &info,
+                                    const std::set<std::string> &changed) {
+    std::set<std::string> reusable;
+    for (auto &name : info.order) {
+        auto files = info.attrs.find(name);
+        if (files == info.attrs.end()) {
+            break;
+        }
+        bool affected = std::any_of(
+            files->second.begin(), files->second.end(),
+            [&](const std::string &file) { return changed.count(file); });
+        if (affected) {
+            break;
+        }
+        reusable.insert(name);
+    }
+    return reusable;
+}
+
+std::string dependencyFileFor(const std::string &output) {
+    std::filesystem::path path(output);
+    return path.replace_extension(".deps.json").string();
+}
+
+void writeDependencies(const std::string &file, const DependencyInfo &info) {
+    json j = json::object({{"version", dependencyVersion},
+                           {"expr", info.releaseExpr},
+                           {"root", info.root},
+                           {"attrs", info.attrs},
+                           {"order", info.order},
+                           {"fingerprints", info.fingerprints}});
+
+    // Readers (e.g. --watch) must never see a partially written file.
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream out(tmp);
+        if (!out.is_open()) {
+            throw Error("cannot open dependency file '%s'", tmp);
+        }
+        out << j.dump(2);
+    }
+    std::filesystem::rename(tmp, file);
+}
+
+DependencyInfo readDependencies(const std::string &file) {
+    std::ifstream in(file);
+    if (!in.is_open()) {
+        throw Error("cannot open dependency file '%s'", file);
+    }
+    json j = json::parse(in);
+    if (j.value("version", 0) != dependencyVersion) {
+        throw Error("unsupported dependency file version in '%s'", file);
+    }
+
+    DependencyInfo info;
+    info.releaseExpr = j.at("expr").get<std::string>();
+    info.root = j.at("root").get<std::set<std::string>>();
+    info.attrs =
+        j.at("attrs").get<std::map<std::string, std::set<std::string>>>();
+    info.order = j.at("order").get<std::vector<std::string>>();
+    info.fingerprints =
+        j.at("fingerprints").get<std::map<std::string, std::string>>();
+    return info;
+}
+
+}; // namespace flutsch
@@ -0,0 +1,161 @@
+#include <nix/error.hh>
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <set>
+
+#include <nlohmann/json.hpp>
+
+#include "diff.hh"
+#include "json-writer.hh"
+#include "records.hh"
+
+using namespace nlohmann;
+
+namespace flutsch {
+
+namespace {
+
+// One side of the merge, checking that its records are sorted.
+class SortedInput {
+  public:
+    explicit SortedInput(const std::string &path) : path(path), reader(path) {
+        advance();
+    }
+
+    const std::optional<json> &current() const { return record; }
+    const std::vector<std::string> &currentPath() const { return key; }
+
+    void advance() {
+        record = reader.next();
+        if (!record) {
+            return;
+        }
+        auto next = record->at("value").at("path")
+                        .get<std::vector<std::string>>();
+        if (next < key) {
+            throw nix::Error("'%s' is not sorted by attribute path, write it "
+                             "with --sorted",
+                             path);
+        }
+        key = std::move(next);
+        // Older outputs list children in no particular order.
+        auto &value = record->at("value");
+        auto children = value.find("children");
+        if (children != value.end() && children->is_array()) {
+            std::sort(children->begin(), children->end(),
+                      [](const json &a, const json &b) {
+                          return a.value("name", "") < b.value("name", "");
+                      });
+        }
+    }
+
+  private:
+    std::string path;
+    RecordReader reader;
+    std::optional<json> record;
+    std::vector<std::string> key;
+};
+
+// Ids into the tables of a single run (--shapes, --error-table). Another
+// run numbers the same shapes and errors differently.
+const std::set<std::string> perRunIds = {"shape", "error_id"};
+
+// Old and new values of the fields of 'section' that differ.
+void diffFields(const json &before, const json &after,
+                const std::string &section, json &fields) {
+    const json &a = before.at(section);
+    const json &b = after.at(section);
+    for (auto &[name, value] : a.items()) {
+        if (perRunIds.contains(name)) {
+            continue;
+        }
+        if (!b.contains(name) || b.at(name) != value) {
+            fields[section + "." + name] = {
+                {"new", b.contains(name) ? b.at(name) : json()},
+                {"old", value}};
+        }
+    }
+    for (auto &[name, value] : b.items()) {
+        if (!a.contains(name) && !perRunIds.contains(name)) {
+            fields[section + "." + name] = {{"new", value}, {"old", json()}};
+        }
+    }
+}
+
+} // namespace
+
+DiffSummary diffOutputs(const std::string &oldPath,
+                        const std::string &newPath,
+                        flutsch::Config const &config) {
+    SortedInput before(oldPath);
+    SortedInput after(newPath);
+
+    std::string filename = config.outFile;
+    std::string tmpFilename = filename + ".tmp";
+    auto sink = openOutput(tmpFilename, config);
+    // Always one change per line, changes are meant to be streamed.
+    JsonWriter out(*sink, 0);
+    DiffSummary summary;
+
+    const auto report = [&](const char *change,
+                            const std::vector<std::string> &path,
+                            const json &detail) {
+        out.beginObject();
+        out.key("change");
+        out.string(change);
+        for (auto &[key, value] : detail.items()) {
+            out.key(key);
+            writeJsonValue(out, value);
+        }
+        out.key("path");
+        out.beginArray();
+        for (auto &segment : path) {
+            out.string(segment);
+        }
+        out.endArray();
+        out.endObject();
+        out.lineBreak();
+    };
+
+    while (before.current() || after.current()) {
+        bool takeOld = before.current() &&
+                       (!after.current() ||
+                        before.currentPath() < after.currentPath());
+        bool takeNew = after.current() &&
+                       (!before.current() ||
+                        after.currentPath() < before.currentPath());
+        if (takeOld) {
+            report("removed", before.currentPath(),
+                   {{"record", *before.current()}});
+            summary.removed++;
+            before.advance();
+        } else if (takeNew) {
+            report("added", after.currentPath(),
+                   {{"record", *after.current()}});
+            summary.added++;
+            after.advance();
+        } else {
+            json fields = json::object();
+            diffFields(*before.current(), *after.current(), "binding",
+                       fields);
+            diffFields(*before.current(), *after.current(), "value",
+                       fields);
+            if (!fields.empty()) {
+                report("changed", after.currentPath(), {{"fields", fields}});
+                summary.changed++;
+            }
+            before.advance();
+            after.advance();
+        }
+    }
+
+    out.flush();
+    sink->finish();
+    std::filesystem::rename(tmpFilename, filename);
+    return summary;
+}
+
+}; // namespace flutsch
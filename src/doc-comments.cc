@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "doc-comments.hh"
+
+namespace flutsch {
+
+static bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Remove the indentation shared by all non-empty lines, and empty lines at
+// both ends. With 'openingLine', the first line starts right after the
+// comment marker, so it is not part of the shared indentation.
+static std::string dedent(std::vector<std::string_view> lines,
+                          bool openingLine) {
+    if (openingLine && !lines.empty()) {
+        size_t first = lines[0].find_first_not_of(" \t");
+        lines[0] = first == std::string_view::npos ? ""
+                                                   : lines[0].substr(first);
+    }
+    size_t indent = std::string_view::npos;
+    for (size_t n = openingLine ? 1 : 0; n < lines.size(); n++) {
+        auto line = lines[n];
+        size_t first = line.find_first_not_of(" \t");
+        if (first != std::string_view::npos) {
+            indent = std::min(indent, first);
+        }
+    }
+    if (indent == std::string_view::npos) {
+        indent = 0;
+    }
+    std::string result;
+    for (size_t n = 0; n < lines.size(); n++) {
+        auto line = lines[n];
+        if (!openingLine || n > 0) {
+            line = line.size() > indent ? line.substr(indent) : "";
+        }
+        while (!line.empty() && isBlank(line.back())) {
+            line.remove_suffix(1);
+        }
+        if (result.empty() && line.empty()) {
+            continue;
+        }
+        result.append(line);
+        result.push_back('\n');
+    }
+    while (!result.empty() && result.back() == '\n') {
+        result.pop_back();
+    }
+    return result;
+}
+
+static std::vector<std::string_view> splitLines(std::string_view text) {
+    std::vector<std::string_view> lines;
+    size_t start = 0;
+    while (true) {
+        size_t end = text.find('\n', start);
+        if (end == std::string_view::npos) {
+            lines.push_back(text.substr(start));
+            return lines;
+        }
+        lines.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+std::optional<std::string> docCommentBefore(std::string_view source,
+                                            size_t offset) {
+    size_t end = std::min(offset, source.size());
+    while (end > 0 && isBlank(source[end - 1])) {
+        end--;
+    }
+
+    if (end >= 2 && source.substr(end - 2, 2) == "*/") {
+        size_t start = source.rfind("/*", end - 2);
+        if (start == std::string_view::npos) {
+            return std::nullopt;
+        }
+        auto body = source.substr(start + 2, end - 2 - (start + 2));
+        // "/**" marks a doc comment, the extra star is not part of it.
+        if (!body.empty() && body.front() == '*') {
+            body.remove_prefix(1);
+        }
+        return dedent(splitLines(body), true);
+    }
+
+    // Line comments, from the last one upwards.
+    std::vector<std::string_view> lines;
+    while (end > 0) {
+        size_t lineStart = source.rfind('\n', end - 1);
+        lineStart = lineStart == std::string_view::npos ? 0 : lineStart + 1;
+        auto line = source.substr(lineStart, end - lineStart);
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string_view::npos || line[first] != '#') {
+            break;
+        }
+        line.remove_prefix(first + 1);
+        lines.push_back(line);
+        if (lineStart == 0) {
+            break;
+        }
+        // Only directly adjacent lines belong to the same comment.
+        end = lineStart - 1;
+        if (end > 0 && source[end - 1] == '\r') {
+            end--;
+        }
+    }
+    if (lines.empty()) {
+        return std::nullopt;
+    }
+    std::reverse(lines.begin(), lines.end());
+    return dedent(lines, false);
+}
+
+SourceFile::SourceFile(const std::string &path) : file(path) {
+    auto text = file.data();
+    lineStarts.push_back(0);
+    for (size_t n = text.find('\n'); n != std::string_view::npos;
+         n = text.find('\n', n + 1)) {
+        lineStarts.push_back(n + 1);
+    }
+}
+
+std::optional<size_t> SourceFile::offsetOf(uint32_t line,
+                                           uint32_t column) const {
+    if (line == 0 || line > lineStarts.size() || column == 0) {
+        return std::nullopt;
+    }
+    size_t offset = lineStarts[line - 1] + column - 1;
+    if (offset > file.data().size()) {
+        return std::nullopt;
+    }
+    return offset;
+}
+
+std::optional<std::string>
+DocComments::before(const std::optional<nix::Pos> &pos) {
+    if (!pos) {
+        return std::nullopt;
+    }
+    auto path = std::get_if<nix::SourcePath>(&pos->origin);
+    if (path == nullptr) {
+        return std::nullopt;
+    }
+    auto file = path->path.abs();
+    auto it = files.find(file);
+    if (it == files.end()) {
+        std::unique_ptr<SourceFile> source;
+        try {
+            source = std::make_unique<SourceFile>(file);
+        } catch (std::runtime_error &) {
+            // Remembered as missing, it will not appear later on.
+        }
+        it = files.emplace(file, std::move(source)).first;
+    }
+    if (!it->second) {
+        return std::nullopt;
+    }
+    auto offset = it->second->offsetOf(pos->line, pos->column);
+    if (!offset) {
+        return std::nullopt;
+    }
+    return docCommentBefore(it->second->text(), *offset);
+}
+
+}; // namespace flutsch
@@ -0,0 +1,145 @@
+#include <nix/error.hh>
+#include <nix/eval.hh>
+#include <nix/nixexpr.hh>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <typeindex>
+#include <unordered_map>
+
+#include <nlohmann/json.hpp>
+
+#include "errors.hh"
+#include "records.hh"
+
+using namespace nix;
+using namespace nlohmann;
+
+namespace flutsch {
+
+namespace {
+// Only a way to name the protected BaseError::err, never instantiated.
+// Nix has no public accessor that leaves the message unformatted.
+struct ErrorInfoAccess : nix::BaseError {
+    static const nix::ErrorInfo &of(const nix::BaseError &error) {
+        return error.*(&ErrorInfoAccess::err);
+    }
+};
+} // namespace
+
+const nix::ErrorInfo &rawErrorInfo(const nix::BaseError &error) {
+    return ErrorInfoAccess::of(error);
+}
+
+// The most specific of the error classes flutsch distinguishes.
+static ErrorKind classifyByCast(const nix::Error &error) {
+    if (dynamic_cast<const RestrictedPathError *>(&error)) {
+        return {"RestrictedPathError", ErrorKind::FullMessage};
+    } else if (dynamic_cast<const MissingArgumentError *>(&error)) {
+        return {"MissingArgumentError"};
+    } else if (dynamic_cast<const UndefinedVarError *>(&error)) {
+        return {"UndefinedVarError"};
+    } else if (dynamic_cast<const TypeError *>(&error)) {
+        return {"TypeError"};
+    } else if (dynamic_cast<const Abort *>(&error)) {
+        return {"Abort"};
+    } else if (dynamic_cast<const ThrownError *>(&error)) {
+        return {"Throw", ErrorKind::Hint};
+    } else if (dynamic_cast<const AssertionError *>(&error)) {
+        return {"AssertionError"};
+    } else if (dynamic_cast<const ParseError *>(&error)) {
+        return {"ParseError"};
+    } else if (dynamic_cast<const EvalError *>(&error)) {
+        return {"EvalError"};
+    } else {
+        return {"Error"};
+    }
+}
+
+const ErrorKind &classifyError(const nix::Error &error) {
+    static thread_local std::unordered_map<std::type_index, ErrorKind> kinds;
+    std::type_index type(typeid(error));
+    auto kind = kinds.find(type);
+    if (kind == kinds.end()) {
+        kind = kinds.emplace(type, classifyByCast(error)).first;
+    }
+    return kind->second;
+}
+
+std::optional<std::string> errorMessage(const nix::Error &error,
+                                        const ErrorKind &kind) {
+    switch (kind.message) {
+    case ErrorKind::Hint:
+        return rawErrorInfo(error).msg.str();
+    case ErrorKind::FullMessage:
+        return error.msg();
+    default:
+        return std::nullopt;
+    }
+}
+
+std::string formatTrace(const nix::Error &error) {
+    std::ostringstream out;
+    for (auto &trace : rawErrorInfo(error).traces) {
+        if (trace.pos && *trace.pos) {
+            out << "at " << *trace.pos << ": ";
+        }
+        out << trace.hint.str() << "\n";
+    }
+    return out.str();
+}
+
+uint64_t ErrorTable::add(const nix::Error &error, const ErrorKind &kind,
+                         const std::optional<std::string> &message,
+                         bool withTrace) {
+    std::optional<Pos> pos;
+    std::string file;
+    if (auto &errPos = rawErrorInfo(error).errPos; errPos && *errPos) {
+        pos = *errPos;
+        if (auto path = std::get_if<SourcePath>(&errPos->origin)) {
+            file = path->path.abs();
+        }
+    }
+    Key key{file, pos ? pos->line : 0, pos ? pos->column : 0, kind.name,
+            message};
+
+    auto [it, inserted] = ids.emplace(std::move(key), entries.size());
+    if (inserted) {
+        std::optional<std::string> trace;
+        if (withTrace) {
+            trace = formatTrace(error);
+        }
+        entries.push_back({kind.name, message, pos, trace});
+    }
+    return it->second;
+}
+
+void ErrorTable::write(const std::string &file) const {
+    json j = json::array();
+    for (size_t id = 0; id < entries.size(); id++) {
+        auto &entry = entries[id];
+        j.push_back(json::object({{"id", id},
+                                  {"type", entry.kind},
+                                  {"message", entry.message},
+                                  {"pos", posToJson(entry.pos)},
+                                  {"trace", entry.trace}}));
+    }
+
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream out(tmp);
+        if (!out.is_open()) {
+            throw Error("cannot open error file '%s'", tmp);
+        }
+        out << j.dump(2);
+    }
+    std::filesystem::rename(tmp, file);
+}
+
+std::string errorFileFor(const std::string &output) {
+    std::filesystem::path path(output);
+    return path.replace_extension(".errors.json").string();
+}
+
+}; // namespace flutsch
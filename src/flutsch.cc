@@ -1,16 +1,20 @@
 #include "args.hh"
 #include "ref.hh"
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <map>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
 #include <string>
 #include <thread>
 #include <fstream>
 #include <filesystem>
 #include <regex>
+#include <set>
 #include <nix/eval-settings.hh>
 #include <nix/config.h>
 #include <nix/shared.hh>
@@ -32,12 +36,30 @@
 #include <nix/installables.hh>
 #include <nix/path-with-outputs.hh>
 #include <nix/installable-flake.hh>
+#include <nix/eval-cache.hh>
 
 #include <nix/value-to-json.hh>
 
 #include "flutsch.hh"
+#include "checkpoint.hh"
+#include "compression.hh"
+#include "deps.hh"
+#include "doc-comments.hh"
+#include "errors.hh"
 #include "eval.hh"
+#include "isolate.hh"
+#include "json-writer.hh"
+#include "position-index.hh"
+#include "progress.hh"
+#include "records.hh"
+#include "search-index.hh"
+#include "shapes.hh"
+#include "shard.hh"
+#include "spsc-queue.hh"
+#include "stats.hh"
 #include "value.hh"
+#include "watch.hh"
+#include "work-queue.hh"
 
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -45,9 +67,12 @@
 
 #include <nlohmann/json.hpp>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include <queue>
+#include <chrono>
+#include <exception>
 
 using namespace nix;
 using namespace nlohmann;
@@ -61,8 +86,6 @@ using namespace nlohmann;
 
 namespace flutsch {
 
-static FlutschMap valueMap;
-
 std::string attrPathJoin(std::vector<std::string> path) {
     return std::accumulate(path.begin(), path.end(), std::string(),
                            [](std::string ss, std::string s) {
@@ -105,31 +128,6 @@ std::vector<std::string> attrPathToPath(std::vector<AttrEntry> path) {
     return result;
 }
 
-static std::pair<std::string, std::optional<std::string>>
-errorInfo(nix::Error *error) {
-    if (nullptr != dynamic_cast<nix::RestrictedPathError *>(error)) {
-        return {std::string("RestrictedPathError"), error->msg()};
-    } else if (nullptr != dynamic_cast<nix::MissingArgumentError *>(error)) {
-        return {std::string("MissingArgumentError"), {}};
-    } else if (nullptr != dynamic_cast<nix::UndefinedVarError *>(error)) {
-        return {std::string("UndefinedVarError"), {}};
-    } else if (nullptr != dynamic_cast<nix::TypeError *>(error)) {
-        return {std::string("TypeError"), {}};
-    } else if (nullptr != dynamic_cast<nix::Abort *>(error)) {
-        return {std::string("Abort"), {}};
-    } else if (nullptr != dynamic_cast<nix::ThrownError *>(error)) {
-        return {std::string("Throw"), error->info().msg.str()};
-    } else if (nullptr != dynamic_cast<nix::AssertionError *>(error)) {
-        return {std::string("AssertionError"), {}};
-    } else if (nullptr != dynamic_cast<nix::ParseError *>(error)) {
-        return {std::string("ParseError"), {}};
-    } else if (nullptr != dynamic_cast<nix::EvalError *>(error)) {
-        return {std::string("EvalError"), {}};
-    } else {
-        return {std::string("Error"), {}};
-    }
-}
-
 void displayAttrs(nix::Value *attrs, ref<EvalState> state) {
     std::cout << "{ ";
     for (auto &i : attrs->attrs->lexicographicOrder(state->symbols)) {
@@ -193,7 +191,8 @@ std::optional<Pos> getPos(ref<EvalState> state, const PosIdx &posIdx) {
         return {};
     }
 
-    if (std::get_if<SourcePath>(&pos.origin) != nullptr) {
+    if (auto path = std::get_if<SourcePath>(&pos.origin)) {
+        addDependency(path->path.abs());
         return {pos};
     }
 
@@ -203,67 +202,176 @@ std::optional<Pos> getPos(ref<EvalState> state, const PosIdx &posIdx) {
     return {};
 }
 
-json posToJson(std::optional<Pos> pos) {
-    if (!pos.has_value()) {
-        json j_null;
-        return j_null;
-    }
-    auto source = std::optional<std::string>({});
-    if (auto path = std::get_if<SourcePath>(&pos.value().origin)) {
-        source = path->path.c_str();
-    }
-    return json::object({{"column", pos.value().column},
-                         {"line", pos.value().line},
-                         {"file", source}});
-}
+// Serialization of output records. Keys are written in sorted order, like
+// nlohmann::json would.
+// With 'docs', the doc comment in front of bindings, lambdas and formals is
+// written as "doc", too.
 
-json attrEntryToJson(const AttrEntry &entry) {
-    return json::object({{"name", entry.name},
-                         {"pos", posToJson(entry.bindPos)},
-                         {"is_root", entry.isRoot}});
+void writeDoc(JsonWriter &out, DocComments *docs,
+              const std::optional<Pos> &pos) {
+    if (docs == nullptr) {
+        return;
+    }
+    out.key("doc");
+    out.optionalString(docs->before(pos));
 }
 
-json childrenToJson(
-    std::unordered_map<std::string, const AttrEntry> &children) {
-    json list = json::array({});
-    for (auto child : children) {
-        list.push_back(attrEntryToJson(child.second));
+void writePos(JsonWriter &out, const std::optional<Pos> &pos) {
+    if (!pos.has_value()) {
+        out.null();
+        return;
     }
-    return list;
+    out.beginObject();
+    out.key("column");
+    out.number(uint64_t(pos->column));
+    out.key("file");
+    if (auto path = std::get_if<SourcePath>(&pos->origin)) {
+        out.string(path->path.abs());
+    } else {
+        out.null();
+    }
+    out.key("line");
+    out.number(uint64_t(pos->line));
+    out.endObject();
 }
 
-json formalIntrospectionToJson(FormalIntrospection &formal) {
-    return json::object({{"name", formal.name},
-                         {"pos", posToJson(formal.pos)},
-                         {"required", formal.required}});
+void writeAttrEntry(JsonWriter &out, const AttrEntry &entry,
+                    DocComments *docs = nullptr) {
+    out.beginObject();
+    writeDoc(out, docs, entry.bindPos);
+    out.key("is_root");
+    out.boolean(entry.isRoot);
+    out.key("name");
+    out.optionalString(entry.name);
+    out.key("pos");
+    writePos(out, entry.bindPos);
+    out.endObject();
 }
 
-json lambdaIntrospectionToJson(LambdaIntrospection &meta) {
-    json j = json::object({{"type", meta.type},
-                           {"pos", posToJson(meta.pos)},
-                           {"arg", meta.arg},
-                           {"formals", json::array({})}});
-
+void writeLambda(JsonWriter &out, const LambdaIntrospection &meta,
+                 DocComments *docs) {
+    out.beginObject();
+    out.key("arg");
+    out.optionalString(meta.arg);
+    writeDoc(out, docs, meta.pos);
+    out.key("formals");
+    out.beginArray();
     if (meta.formals.has_value()) {
-        for (auto formal : meta.formals.value()) {
-            j["formals"].push_back(formalIntrospectionToJson(formal));
+        for (auto &formal : meta.formals.value()) {
+            out.beginObject();
+            writeDoc(out, docs, formal.pos);
+            out.key("name");
+            out.string(formal.name);
+            out.key("pos");
+            writePos(out, formal.pos);
+            out.key("required");
+            out.boolean(formal.required);
+            out.endObject();
         }
     }
-    return j;
+    out.endArray();
+    out.key("pos");
+    writePos(out, meta.pos);
+    out.key("type");
+    out.string(meta.type);
+    out.endObject();
 }
 
-json lambdaMapToJson(
-    std::optional<std::unordered_map<uint, LambdaIntrospection>> &lambdas) {
+void writeLambdaMap(
+    JsonWriter &out,
+    const std::optional<std::unordered_map<uint, LambdaIntrospection>>
+        &lambdas,
+    DocComments *docs) {
     if (!lambdas.has_value()) {
-        json j_null;
-        return j_null;
+        out.null();
+        return;
     }
-
-    json j = json::object({});
+    std::map<std::string, const LambdaIntrospection *> sorted;
     for (auto &i : lambdas.value()) {
-        j[std::to_string(i.first)] = lambdaIntrospectionToJson(i.second);
+        sorted.emplace(std::to_string(i.first), &i.second);
+    }
+    out.beginObject();
+    for (auto &[key, meta] : sorted) {
+        out.key(key);
+        writeLambda(out, *meta, docs);
+    }
+    out.endObject();
+}
+
+// A single output record: the binding and the introspected value behind it.
+void writeRecord(JsonWriter &out, const AttrEntry &binding,
+                 const ValueIntrospection &value,
+                 DocComments *docs = nullptr) {
+    out.beginObject();
+    out.key("binding");
+    writeAttrEntry(out, binding, docs);
+
+    out.key("value");
+    out.beginObject();
+    if (!value.shape.has_value()) {
+        out.key("children");
+        out.beginArray();
+        // By name, so that the output does not depend on the hash map.
+        std::vector<const std::pair<const std::string, const AttrEntry> *>
+            children;
+        children.reserve(value.children.size());
+        for (auto &child : value.children) {
+            children.push_back(&child);
+        }
+        std::sort(children.begin(), children.end(),
+                  [](auto a, auto b) { return a->first < b->first; });
+        for (auto child : children) {
+            writeAttrEntry(out, child->second);
+        }
+        out.endArray();
+    }
+    if (value.count.has_value()) {
+        out.key("count");
+        out.number(uint64_t(*value.count));
+        out.key("element_types");
+        if (value.elementTypes) {
+            out.beginObject();
+            for (auto &[type, n] : *value.elementTypes) {
+                out.key(type);
+                out.number(uint64_t(n));
+            }
+            out.endObject();
+        } else {
+            out.null();
+        }
+    }
+    out.key("error");
+    out.boolean(value.isError);
+    if (value.errorId.has_value()) {
+        out.key("error_id");
+        out.number(uint64_t(*value.errorId));
+    } else {
+        out.key("error_description");
+        out.optionalString(value.errorDescription);
+    }
+    out.key("lambda");
+    writeLambdaMap(out, value.lambdaIntrospections, docs);
+    out.key("path");
+    out.beginArray();
+    for (auto &segment : value.path) {
+        out.string(segment);
+    }
+    out.endArray();
+    out.key("pos");
+    writePos(out, value.valuePos);
+    if (value.count.has_value()) {
+        out.key("sampled");
+        out.boolean(value.sampled);
+    }
+    if (value.shape.has_value()) {
+        out.key("shape");
+        out.number(uint64_t(*value.shape));
     }
-    return j;
+    out.key("type");
+    out.optionalString(value.valueType);
+    out.endObject();
+
+    out.endObject();
 }
 
 void displayFormals(std::vector<FormalIntrospection> &formals) {
@@ -313,6 +421,16 @@ std::uintptr_t getPtr(Value &value) {
     return ptr_val;
 }
 
+template <typename T>
+bool intersects(const std::set<T> &a, const std::set<T> &b) {
+    for (auto &i : a) {
+        if (b.count(i)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 bool startsWithDoubleUnderscore(const std::string &str) {
     if (str.length() >= 2) {
         return str.substr(0, 2) == "__";
@@ -320,6 +438,16 @@ bool startsWithDoubleUnderscore(const std::string &str) {
     return false;
 }
 
+bool isDerivation(EvalState &state, Value &value) {
+    Attr *drvPath = value.attrs->get(state.symbols.create("drvPath"));
+    if (drvPath == nullptr) {
+        return false;
+    }
+    state.forceValue(*drvPath->value, drvPath->pos);
+    return drvPath->value->type() == nString &&
+           drvPath->value->string.context != nullptr;
+}
+
 std::string describe(Value &v) {
 
     if (v.isLambda()) {
@@ -338,6 +466,110 @@ std::string describe(Value &v) {
     return std::string(repr);
 }
 
+// Name of the type of 'v' as written to the output. Does not force 'v'.
+std::string valueTypeName(Value &v) {
+    switch (v.type()) {
+    case nInt:
+        return "int";
+    case nBool:
+        return "bool";
+    case nString:
+        return "string";
+    case nPath:
+        return "path";
+    case nNull:
+        return "null";
+    case nAttrs:
+        return "attrset";
+    case nList:
+        return "list";
+    // TODO: nFunction has lambda, primop, primopApp
+    case nFunction: {
+        std::string t = "unknown function type";
+        if (v.isLambda()) {
+            t = "lambda";
+        }
+        if (v.isPrimOp()) {
+            t = "primop";
+        }
+        if (v.isPrimOpApp()) {
+            t = "primopApp";
+        }
+        return t;
+    }
+    case nExternal:
+        return v.external->typeOf();
+    case nFloat:
+        return "float";
+    case nThunk:
+        return "thunk";
+    default:
+        return "unknown";
+    }
+}
+
+std::vector<size_t> sampleIndices(size_t size, flutsch::Config const &config) {
+    std::vector<size_t> indices;
+    if (config.sampleThreshold == 0 || size <= config.sampleThreshold ||
+        size <= config.sampleSize) {
+        indices.resize(size);
+        std::iota(indices.begin(), indices.end(), 0);
+        return indices;
+    }
+    // A quarter of the sample at either end, the rest strided in between.
+    size_t edge = config.sampleSize / 4;
+    size_t middle = config.sampleSize - 2 * edge;
+    size_t span = size - 2 * edge;
+    for (size_t i = 0; i < edge; i++) {
+        indices.push_back(i);
+    }
+    for (size_t i = 0; i < middle; i++) {
+        indices.push_back(edge + i * span / middle);
+    }
+    for (size_t i = size - edge; i < size; i++) {
+        indices.push_back(i);
+    }
+    return indices;
+}
+
+// Whether 'name' is a Nix system flakes define outputs for. A pattern
+// would also match attributes like "util-linux".
+static bool isSystemName(const std::string &name,
+                         const std::string &canonicalSystem) {
+    // lib.systems.flakeExposed of nixpkgs
+    static const std::set<std::string> systems = {
+        "x86_64-linux",   "aarch64-linux",     "x86_64-darwin",
+        "armv6l-linux",   "armv7l-linux",      "i686-linux",
+        "aarch64-darwin", "armv5tel-linux",    "powerpc64le-linux",
+        "riscv64-linux",  "x86_64-freebsd",
+    };
+    return name == canonicalSystem || systems.count(name);
+}
+
+// Index of the first system in 'path', if any.
+static std::optional<size_t> systemSegment(const std::vector<AttrEntry> &path,
+                                           const std::string &canonicalSystem) {
+    for (size_t n = 1; n < path.size(); n++) {
+        if (path[n].name && isSystemName(*path[n].name, canonicalSystem)) {
+            return n;
+        }
+    }
+    return {};
+}
+
+// 'path' without the system at 'segment', to match the same definition
+// across systems.
+static std::string systemlessPath(const std::vector<AttrEntry> &path,
+                                  size_t segment) {
+    auto names = attrPathToPath(path);
+    names[segment] = "<system>";
+    return attrPathJoin(names);
+}
+
+std::string elementName(size_t index) {
+    return "[" + std::to_string(index) + "]";
+}
+
 typedef std::shared_ptr<nix::Value> SharedValueRef;
 typedef std::vector<SharedValueRef> SharedValueRefs;
 
@@ -381,24 +613,19 @@ callFnWithAutoAttrs(nix::Value &value, ref<EvalState> state,
     return res;
 }
 
-LambdaIntrospection introspectLambda(Value &value, ref<EvalState> state) {
-    if (!value.isLambda()) {
-        std::cout << "introspectLambda: called with non lambda value "
-                  << value.type() << std::endl;
-        return {};
-    }
-
-    PosIdx currPos = value.lambda.fun->getPos();
+LambdaIntrospection introspectExprLambda(ExprLambda &fun,
+                                         ref<EvalState> state) {
+    PosIdx currPos = fun.getPos();
     std::optional<std::string> arg;
     std::optional<std::vector<FormalIntrospection>> formals = {};
     // Collect informations about the current lambda
     // -----------------------------------------
     // 1. argument name if it has one
-    if (!value.lambda.fun->hasFormals()) {
-        arg = state->symbols[value.lambda.fun->arg];
+    if (!fun.hasFormals()) {
+        arg = state->symbols[fun.arg];
     }
     // 2. all formals, if it has formals.
-    if (value.lambda.fun->hasFormals()) {
+    if (fun.hasFormals()) {
         // A formal looks like this:
         //
         // {a, b, ... }@args: body
@@ -412,7 +639,7 @@ LambdaIntrospection introspectLambda(Value &value, ref<EvalState> state) {
         // TODO: can we add the name of @args?
         std::vector<FormalIntrospection> formalsResult;
 
-        for (Formal formal : value.lambda.fun->formals->formals) {
+        for (Formal formal : fun.formals->formals) {
             // Find out if the formal is required
             Value reqValue;
             reqValue.mkBool(formal.def);
@@ -424,7 +651,7 @@ LambdaIntrospection introspectLambda(Value &value, ref<EvalState> state) {
         }
 
         // Add the ellipsis at the end if exists
-        if (value.lambda.fun->formals->ellipsis) {
+        if (fun.formals->ellipsis) {
             formalsResult.push_back(FormalIntrospection({"...", {}, false}));
         }
 
@@ -437,6 +664,66 @@ LambdaIntrospection introspectLambda(Value &value, ref<EvalState> state) {
     return LambdaIntrospection({"lambda", pos, arg, formals});
 }
 
+LambdaIntrospection introspectLambda(Value &value, ref<EvalState> state) {
+    if (!value.isLambda()) {
+        std::cout << "introspectLambda: called with non lambda value "
+                  << value.type() << std::endl;
+        return {};
+    }
+    return introspectExprLambda(*value.lambda.fun, state);
+}
+
+// Whether 'expr' certainly evaluates to something that cannot be called.
+static bool isNeverCallable(Expr *expr, ref<EvalState> state) {
+    if (auto attrs = dynamic_cast<ExprAttrs *>(expr)) {
+        // A dynamic attribute could still be named __functor.
+        return attrs->dynamicAttrs.empty() &&
+               attrs->attrs.find(state->symbols.create("__functor")) ==
+                   attrs->attrs.end();
+    }
+    return dynamic_cast<ExprInt *>(expr) || dynamic_cast<ExprFloat *>(expr) ||
+           dynamic_cast<ExprString *>(expr) || dynamic_cast<ExprPath *>(expr) ||
+           dynamic_cast<ExprList *>(expr) ||
+           dynamic_cast<ExprConcatStrings *>(expr) ||
+           dynamic_cast<ExprOpNot *>(expr) || dynamic_cast<ExprOpEq *>(expr) ||
+           dynamic_cast<ExprOpNEq *>(expr) || dynamic_cast<ExprOpAnd *>(expr) ||
+           dynamic_cast<ExprOpOr *>(expr) || dynamic_cast<ExprOpImpl *>(expr) ||
+           dynamic_cast<ExprOpHasAttr *>(expr) ||
+           dynamic_cast<ExprOpConcatLists *>(expr) ||
+           dynamic_cast<ExprPos *>(expr);
+}
+
+// Same result as unwrapLambda, but read from the syntax tree instead of
+// calling the function. Follows the body through nested lambdas, let, with
+// and assert. Returns nothing if the body ends in an expression whose value
+// is only known after evaluation, e.g. an application or a variable.
+std::optional<std::unordered_map<uint, LambdaIntrospection>>
+staticUnwrapLambda(ExprLambda &fun, ref<EvalState> state) {
+    std::unordered_map<uint, LambdaIntrospection> result;
+    Expr *body = &fun;
+    uint counter = 0;
+    while (true) {
+        if (auto lambda = dynamic_cast<ExprLambda *>(body)) {
+            // Same depth limit as unwrapLambda
+            if (counter >= 10) {
+                return result;
+            }
+            result.emplace(counter++, introspectExprLambda(*lambda, state));
+            body = lambda->body;
+        } else if (auto let = dynamic_cast<ExprLet *>(body)) {
+            body = let->body;
+        } else if (auto with = dynamic_cast<ExprWith *>(body)) {
+            body = with->body;
+        } else if (auto assertion = dynamic_cast<ExprAssert *>(body)) {
+            body = assertion->body;
+        } else if (isNeverCallable(body, state)) {
+            return result;
+        } else {
+            return std::nullopt;
+        }
+    }
+}
+
 std::unordered_map<uint, LambdaIntrospection>
 unwrapLambda(nix::Value lambdaOrFunctor, ref<EvalState> state) {
     // The result of the lambda will be stored in vTmp
@@ -660,8 +947,9 @@ void Analyzer::bfs_traverse() {
         // displayAttrs(test, state);
 
         if (current_node.type() == nAttrs) {
-            for (auto &i :
-                current_node.attrs->lexicographicOrder(state->symbols)) {
+            auto sorted = current_node.attrs->lexicographicOrder(state->symbols);
+            for (size_t index : sampleIndices(sorted.size(), config)) {
+                auto &i = sorted[index];
 
                 const std::string &name = state->symbols[i->name];
                 const PosIdx childPos = i->pos;
@@ -714,14 +1002,17 @@ void Analyzer::bfs_traverse() {
                 } catch (nix::Error &e) {
                 }
             }
+        } else if (current_node.type() == nList && config.traverseLists) {
+            auto elems = current_node.listElems();
+            for (size_t index :
+                 sampleIndices(current_node.listSize(), config)) {
+                try {
+                    state->forceValue(*elems[index], noPos);
+                    queue.push({*elems[index], path + elementName(index)});
+                } catch (nix::Error &e) {
+                }
+            }
         }
-        // else if (current_node.is_array()) {
-        //     int index = 0;
-        //     for (auto& value : current_node) {
-        //         queue.push({value, path + "[" + std::to_string(index++) +
-        //         "]"});
-        //     }
-        // }
     }
 }
 
@@ -741,32 +1032,182 @@ void Analyzer::bfs_traverse() {
 // std::cout << "Root introspection done" << std::endl;
 // recurseValues(initPath, vRoot);
 
-void getPositions(MixEvalArgs &args, flutsch::Config const &config) {
-    std::cout << "positionsEval" << std::endl;
+// Identity of an entry that no longer holds on to its value: the pointer,
+// complemented like GC_HIDE_POINTER so that it is never mistaken for a
+// reference by the garbage collector, and a hash of the name. 16 bytes, no
+// matter how long the name is.
+using EntryIdentity = std::pair<std::uintptr_t, size_t>;
 
-    auto state = ref<EvalState>(std::make_shared<EvalState>(
-        args.searchPath, openStore(*args.evalStoreUrl)));
-    Bindings &autoArgs = *args.getAutoArgs(*state);
+static EntryIdentity identityOf(const AttrEntry &entry) {
+    return {~reinterpret_cast<std::uintptr_t>(entry.value),
+            std::hash<std::string>{}(entry.name.value_or(""))};
+}
 
-    nix::Value *vRoot = [&]() {
-        if (config.flake) {
-            auto [flakeRef, fragment, outputSpec] =
-                parseFlakeRefWithFragmentAndExtendedOutputsSpec(
-                    config.releaseExpr, absPath("."));
-            InstallableFlake flake{
-                {}, state, std::move(flakeRef), fragment, outputSpec,
-                {}, {},    config.lockFlags};
+struct EntryIdentityHash {
+    size_t operator()(const EntryIdentity &identity) const {
+        return identity.first * 0x9e3779b97f4a7c15ULL ^ identity.second;
+    }
+};
+
+// Drop all Value pointers of a finished record. Entries are identified by
+// their id from here on.
+static void releaseValues(OutputRecord &record) {
+    record.binding.value = nullptr;
+    std::unordered_map<std::string, const AttrEntry> children;
+    for (auto &[name, child] : record.value.children) {
+        AttrEntry released = child;
+        released.value = nullptr;
+        children.emplace(name, released);
+    }
+    record.value.children = std::move(children);
+}
 
-            return flake.toValue(*state).first;
-        } else {
-            return releaseExprTopLevelValue(*state, autoArgs, config);
+// Indexes built from the finished output file.
+static void writeIndexes(const std::string &filename,
+                         flutsch::Config const &config) {
+    if (config.searchIndex) {
+        auto indexFile = searchIndexFileFor(filename);
+        writeSearchIndex(filename, indexFile);
+        std::cout << "Search index written to: " << indexFile << std::endl;
+    }
+    if (config.positionIndex) {
+        auto indexFile = positionIndexFileFor(filename);
+        writePositionIndex(filename, indexFile);
+        std::cout << "Position index written to: " << indexFile << std::endl;
+    }
+}
+
+static void writeRunStats(const RunStats &stats, const std::string &filename,
+                          flutsch::Config const &config) {
+    if (!config.stats) {
+        return;
+    }
+    auto statsFile = statsFileFor(filename);
+    writeStats(stats, statsFile);
+    std::cout << "Statistics written to: " << statsFile << std::endl;
+}
+
+// The flake output or release expression to introspect.
+static nix::Value *rootValue(ref<EvalState> state, Bindings &autoArgs,
+                             flutsch::Config const &config) {
+    if (config.flake) {
+        auto [flakeRef, fragment, outputSpec] =
+            parseFlakeRefWithFragmentAndExtendedOutputsSpec(config.releaseExpr,
+                                                            absPath("."));
+        InstallableFlake flake{
+            {}, state, std::move(flakeRef), fragment, outputSpec,
+            {}, {},    config.lockFlags};
+
+        return flake.toValue(*state).first;
+    }
+    return releaseExprTopLevelValue(*state, autoArgs, config);
+}
+
+// One of several passes over the same root, running on their own threads.
+struct Worker {
+    size_t index;
+    // Names of the top-level attributes, shared by all workers.
+    WorkStealingQueue<std::string> &jobs;
+    // Receives the finished records instead of the output file.
+    std::vector<OutputRecord> &records;
+    RunStats &stats;
+    // Entries introspected by all workers, so that maxEntries does not
+    // depend on the number of workers.
+    std::atomic<uint64_t> &entries;
+};
+
+// A single introspection pass: evaluates the root and writes the results.
+// 'state' must have been prepared with trackImports if dependencies are
+// tracked.
+// With 'worker', only the top-level attributes taken from its queue are
+// introspected, and only worker 0 reports the root.
+static void analyze(ref<EvalState> state, Bindings &autoArgs,
+                    flutsch::Config const &config, Progress &progress,
+                    Worker *worker = nullptr) {
+    // Everything introspected in this pass. Local, so that passes can run
+    // one after another (or concurrently) in the same process.
+    FlutschMap valueMap;
+
+    // Workers report to analyzeParallel, which merges their statistics.
+    RunStats ownStats;
+    RunStats &stats = worker ? worker->stats : ownStats;
+
+    bool trackDeps =
+        config.trackDependencies || config.previousOutput.has_value();
+    DependencyInfo deps{config.releaseExpr};
+
+    nix::Value *vRoot = [&]() {
+        PhaseTimer timer(stats, "root_eval");
+        std::optional<DependencyScope> scope;
+        if (trackDeps) {
+            scope.emplace(deps.root);
         }
+        return rootValue(state, autoArgs, config);
     }();
 
     if (vRoot->type() != nAttrs) {
         throw EvalError("Top level attribute is not an attrset");
     }
 
+    // Finished subtrees of a previous, interrupted run.
+    Checkpoint checkpoint{config.releaseExpr};
+    if (config.resumeDir) {
+        auto resumed = readCheckpoint(*config.resumeDir);
+        if (!resumed) {
+            throw Error("no checkpoint found in '%s'", *config.resumeDir);
+        }
+        if (resumed->releaseExpr != config.releaseExpr) {
+            throw Error("checkpoint in '%s' was created for '%s'",
+                        *config.resumeDir, resumed->releaseExpr);
+        }
+        checkpoint = std::move(*resumed);
+        std::cout << "Resuming: skipping " << checkpoint.done.size()
+                  << " finished top-level attributes" << std::endl;
+    }
+    // Keep checkpointing into the directory we resumed from.
+    auto checkpointDir =
+        config.checkpointDir ? config.checkpointDir : config.resumeDir;
+    auto lastCheckpoint = std::chrono::steady_clock::now();
+
+    // Top-level attributes whose records can be taken from a previous run,
+    // because none of the files they depend on changed.
+    std::set<std::string> reusable;
+    std::set<std::string> reused;
+    DependencyInfo previousDeps;
+    json previousRecords = json::array();
+    if (config.previousOutput) {
+        previousDeps =
+            readDependencies(dependencyFileFor(*config.previousOutput));
+        auto changed = config.changedFiles.empty()
+                           ? changedFiles(previousDeps)
+                           : std::set<std::string>(config.changedFiles.begin(),
+                                                   config.changedFiles.end());
+
+        if (previousDeps.releaseExpr != config.releaseExpr ||
+            intersects(previousDeps.root, changed)) {
+            std::cout << "Root dependencies changed: analyzing everything"
+                      << std::endl;
+        } else {
+            reusable = reusableAttrs(previousDeps, changed);
+            // Only the records that can be reused are kept. They must be
+            // read before the output, often the same file, is replaced.
+            RecordReader reader(*config.previousOutput);
+            while (auto record = reader.next()) {
+                auto &path = record->at("value").at("path");
+                if (path.size() >= 2 &&
+                    reusable.count(path[1].get<std::string>())) {
+                    previousRecords.push_back(std::move(*record));
+                }
+            }
+        }
+        std::cout << "Incremental: " << changed.size() << " changed files, "
+                  << reusable.size() << " reusable top-level attributes"
+                  << std::endl;
+    }
+
+    // Distinct errors, if they are written to a separate table.
+    ErrorTable errors;
+
     // Add a single entry from nixValue
     const auto introspectValue = [&](std::vector<AttrEntry> attrPath,
                                      nix::Value *test) {
@@ -775,6 +1216,7 @@ void getPositions(MixEvalArgs &args, flutsch::Config const &config) {
                   << std::endl;
         // ValueMap entry where we will add the value introspection results.
         auto data = valueMap.find(attrPath.back());
+        stats.valuesForced++;
 
         try {
             state->forceValue(*test, noPos);
@@ -793,6 +1235,7 @@ void getPositions(MixEvalArgs &args, flutsch::Config const &config) {
                     std::cout << "is functor" << std::endl;
                     type = std::string("attrset/functor");
                     auto meta = unwrapLambda(*test, state);
+                    stats.addUnwrap(meta.size(), true);
 
                     data->second.lambdaIntrospections.emplace(meta);
 
@@ -800,8 +1243,14 @@ void getPositions(MixEvalArgs &args, flutsch::Config const &config) {
                 }
                 // If the value is an attrset, add all its attributes as
                 // children
-                for (auto &i :
-                     test->attrs->lexicographicOrder(state->symbols)) {
+                auto sorted = test->attrs->lexicographicOrder(state->symbols);
+                auto indices = sampleIndices(sorted.size(), config);
+                if (data != valueMap.end() && indices.size() < sorted.size()) {
+                    data->second.count = sorted.size();
+                    data->second.sampled = true;
+                }
+                for (size_t index : indices) {
+                    auto &i = sorted[index];
                     const std::string &name = state->symbols[i->name];
                     const PosIdx childPos = i->pos;
 
@@ -819,6 +1268,20 @@ void getPositions(MixEvalArgs &args, flutsch::Config const &config) {
                 }
             }
 
+            if (test->type() == nList && data != valueMap.end()) {
+                data->second.count = test->listSize();
+                if (config.traverseLists) {
+                    auto elems = test->listElems();
+                    auto indices = sampleIndices(test->listSize(), config);
+                    data->second.sampled = indices.size() < test->listSize();
+                    for (size_t index : indices) {
+                        auto name = elementName(index);
+                        data->second.children.emplace(
+                            name, AttrEntry(elems[index], name, {}));
+                    }
+                }
+            }
+
             if (test->isLambda()) {
                 // attrPath.back().name;
                 // There are 3 different types of functions:
@@ -838,7 +1301,17 @@ void getPositions(MixEvalArgs &args, flutsch::Config const &config) {
                 // If the value is a lambda then we want to unwrap it until we
                 // get something else
                 if (attrPath.back().name.value_or("") != "__functor") {
-                    auto meta = unwrapLambda(*test, state);
+                    std::optional<std::unordered_map<uint, LambdaIntrospection>>
+                        staticMeta;
+                    if (config.staticLambdas) {
+                        staticMeta =
+                            staticUnwrapLambda(*test->lambda.fun, state);
+                    }
+                    // Only apply the function if the syntax tree alone is
+                    // inconclusive.
+                    auto meta = staticMeta ? *staticMeta
+                                           : unwrapLambda(*test, state);
+                    stats.addUnwrap(meta.size(), false);
                     data->second.lambdaIntrospections.emplace(meta);
                     displayUnwrappedLambda(meta);
                 } else {
@@ -856,74 +1329,36 @@ void getPositions(MixEvalArgs &args, flutsch::Config const &config) {
                     data->second.valuePos.reset();
                 }
 
-                std::string t;
-                switch (test->type()) {
-                case nInt:
-                    t = "int";
-                    break;
-                case nBool:
-                    t = "bool";
-                    break;
-                case nString:
-                    t = "string";
-                    break;
-                case nPath:
-                    t = "path";
-                    break;
-                case nNull:
-                    t = "null";
-                    break;
                 // Either attrset or functor
-                case nAttrs:
-                    t = type;
-                    break;
-                case nList:
-                    t = "list";
-                    break;
-                // TODO: nFunction has lambda, primop, primopApp
-                case nFunction: {
-                    t = "unknown function type";
-                    if (test->isLambda()) {
-                        t = "lambda";
-                    }
-                    if (test->isPrimOp()) {
-                        t = "primop";
-                    }
-                    if (test->isPrimOpApp()) {
-                        t = "primopApp";
-                    }
-                    break;
-                }
-                case nExternal:
-                    t = test->external->typeOf();
-                    break;
-                case nFloat:
-                    t = "float";
-                    break;
-                case nThunk:
-                    t = "thunk";
-                    break;
-                default:
-                    t = "unknown";
-                    break;
-                }
-                data->second.valueType = t;
+                data->second.valueType =
+                    test->type() == nAttrs ? type : valueTypeName(*test);
             }
 
         } catch (nix::Error &e) {
             if (data != valueMap.end()) {
                 data->second.isError = true;
 
-                auto pos = e.info().errPos;
+                auto pos = rawErrorInfo(e).errPos;
 
                 std::cout << "inserting error: " << data->first << std::endl;
                 bool hasPos = pos && *pos;
                 if (hasPos) {
                     data->second.valuePos.emplace(*pos);
+                    if (auto path = std::get_if<SourcePath>(&pos->origin)) {
+                        addDependency(path->path.abs());
+                    }
+                }
+                auto &kind = classifyError(e);
+                stats.errors[kind.name]++;
+                progress.fail();
+                data->second.valueType = kind.name;
+                auto message = errorMessage(e, kind);
+                if (config.errorTable) {
+                    data->second.errorId =
+                        errors.add(e, kind, message, config.showTrace);
+                } else {
+                    data->second.errorDescription = message;
                 }
-                auto errorPair = errorInfo(&e);
-                data->second.valueType = errorPair.first;
-                data->second.errorDescription = errorPair.second;
             }
         }
         // Finally
@@ -933,169 +1368,1208 @@ void getPositions(MixEvalArgs &args, flutsch::Config const &config) {
         }
     };
 
-    // Recurse into test attrset
+    // Top-level attribute whose evaluation ran into a stack guard. Frames
+    // of the EvalState were abandoned without unwinding, so nothing is
+    // evaluated after it.
+    std::optional<std::string> overflowedIn;
+
+    // Run 'fn' on a large isolated stack, if enabled.
+    // A stack overflow is recorded as error of the value behind 'key'.
+    const auto runIsolated = [&](const AttrEntry &key,
+                                 const std::function<void()> &fn) {
+        if (config.stackSize == 0) {
+            fn();
+            return;
+        }
+        auto result = runOnLargeStack(config.stackSize * 1024 * 1024, fn);
+        if (result == IsolationResult::StackOverflow) {
+            auto data = valueMap.find(key);
+            std::cout << "stack overflow while introspecting: " << key
+                      << std::endl;
+            stats.errors["StackOverflow"]++;
+            progress.fail();
+            overflowedIn = key.name.value_or("<root>");
+            if (data != valueMap.end()) {
+                data->second.isError = true;
+                data->second.isIntrospected = true;
+                data->second.valueType = "StackOverflow";
+                data->second.errorDescription =
+                    "stack overflow (possible infinite recursion)";
+            }
+        }
+    };
+
+    // Ids handed out to tracked entries so far.
+    uint64_t nextId = 0;
+    // Entries counted against maxEntries.
+    std::atomic<uint64_t> ownEntries{0};
+    std::atomic<uint64_t> &entries = worker ? worker->entries : ownEntries;
+    // Every worker introspects the root, but only one reports it.
+    bool reportsRoot = !worker || worker->index == 0;
+    // With config.lowMemory, entries leave valueMap once they are emitted.
+    // Only their identity is remembered, so that shared values are still
+    // introspected only once. Every visited value stays reachable from the
+    // root during a pass, so an address is never reused for another value.
+    std::unordered_set<EntryIdentity, EntryIdentityHash> emitted;
+
+    // Every emitted record is appended to the checkpoint right away, a
+    // checkpoint only commits them together with the finished top-level
+    // attributes.
+    std::optional<CheckpointWriter> checkpointWriter;
+    if (checkpointDir) {
+        checkpointWriter.emplace(*checkpointDir, checkpoint);
+    }
+    const auto saveCheckpoint = [&]() {
+        checkpointWriter->commit(checkpoint.done);
+        lastCheckpoint = std::chrono::steady_clock::now();
+        std::cout << "Checkpoint written to: " << *checkpointDir << std::endl;
+    };
+
+    // Shapes of all emitted entries, by identity.
+    ShapeTable shapes;
+    std::unordered_map<EntryIdentity, uint64_t, EntryIdentityHash> shapeOf;
+    const auto assignShape = [&](const AttrEntry &key,
+                                 ValueIntrospection &value) {
+        Shape shape{value.valueType.value_or("unknown")};
+        bool isAttrset = !value.isError && shape.type.starts_with("attrset");
+        if (isAttrset && value.sampled) {
+            // The children are not the whole attrset
+            shape.type = "sampled " + shape.type;
+        } else if (isAttrset) {
+            std::map<std::string, uint64_t> fields;
+            for (auto &[name, child] : value.children) {
+                // Children that were never visited, or are being visited
+                // right now, e.g. in 'rec { a = { inherit a; }; }'.
+                auto known = shapeOf.find(identityOf(child));
+                fields[name] = known != shapeOf.end()
+                                   ? known->second
+                                   : shapes.intern({"unknown"});
+            }
+            shape.fields.assign(fields.begin(), fields.end());
+        }
+        auto id = shapes.intern(std::move(shape));
+        shapeOf[identityOf(key)] = id;
+        if (isAttrset && !value.sampled) {
+            value.shape = id;
+        }
+    };
+
+    // Finished records are serialized on a separate thread, while the
+    // evaluation continues.
+    SpscQueue<OutputRecord> records(4096);
+    // Entries whose subtree is being visited right now, innermost last.
+    std::vector<AttrEntry> openEntries;
+    const auto emit = [&](const AttrEntry &key) {
+        auto data = valueMap.find(key);
+        if (data == valueMap.end()) {
+            return;
+        }
+        if (config.shapes) {
+            assignShape(data->first, data->second);
+        }
+        // The root is cheap and introspected again on resume.
+        if (checkpointWriter && !key.isRoot) {
+            StringSink line;
+            {
+                JsonWriter out(line, 0);
+                writeRecord(out, data->first, data->second);
+            }
+            checkpointWriter->add(line.data);
+        }
+        if (!config.lowMemory) {
+            records.push({data->first, data->second});
+            return;
+        }
+        OutputRecord record{data->first, std::move(data->second)};
+        valueMap.erase(data);
+        emitted.insert(identityOf(record.binding));
+        releaseValues(record);
+        records.push(std::move(record));
+    };
+
+    // Count the value types of the elements of a list or a sampled attrset.
+    const auto summarizeElements = [&](const AttrEntry &key,
+                                       nix::Value *value) {
+        auto data = valueMap.find(key);
+        if (data == valueMap.end() || !data->second.count) {
+            return;
+        }
+        std::map<std::string, size_t> types;
+        if (value->type() == nList) {
+            if (!config.traverseLists) {
+                return;
+            }
+            auto elems = value->listElems();
+            for (size_t n = 0; n < value->listSize(); n++) {
+                types[valueTypeName(*elems[n])]++;
+            }
+        } else if (value->type() == nAttrs) {
+            for (auto &attr : *value->attrs) {
+                types[valueTypeName(*attr.value)]++;
+            }
+        }
+        data->second.elementTypes = std::move(types);
+    };
+
+    // Binding position of every definition below the canonical system, by
+    // systemless path.
+    std::string canonicalSystem =
+        config.canonicalSystem.value_or(settings.thisSystem.get());
+    std::unordered_map<std::string, Pos> canonicalDefs;
+    // Whether 'path' is bound at the same position as a definition that was
+    // already introspected for the canonical system. Decided before 'path'
+    // is introspected, so that copies are never evaluated.
+    const auto isSystemCopy = [&](const std::vector<AttrEntry> &path) {
+        if (!config.dedupeSystems || !path.back().bindPos) {
+            return false;
+        }
+        auto segment = systemSegment(path, canonicalSystem);
+        if (!segment) {
+            return false;
+        }
+        std::string key = systemlessPath(path, *segment);
+        if (path[*segment].name == canonicalSystem) {
+            canonicalDefs.emplace(key, *path.back().bindPos);
+            return false;
+        }
+        // The system attrset itself is always kept.
+        if (*segment == path.size() - 1) {
+            return false;
+        }
+        auto def = canonicalDefs.find(key);
+        return def != canonicalDefs.end() &&
+               def->second == *path.back().bindPos;
+    };
+
     std::function<void(std::vector<AttrEntry>, nix::Value *)> recurseValues;
+    std::function<void(std::vector<AttrEntry>, nix::Value *)> recurseList;
+
+    // Introspect a single attribute or list element of 'parentValue' and
+    // everything below it.
+    std::function<void(const std::vector<AttrEntry> &, AttrEntry,
+                       nix::Value *)>
+        visitChild;
+    visitChild = [&](const std::vector<AttrEntry> &attrPath,
+                     AttrEntry attrEntry, nix::Value *parentValue) -> void {
+        const std::string name = attrEntry.name.value_or("");
+        nix::Value *childValue = attrEntry.value;
+        stats.nodesVisited++;
+        progress.visit();
+
+        // Copy and append current attribute
+        std::vector<AttrEntry> curAttrPath = attrPath;
+
+        // Already written and released.
+        if (config.lowMemory && emitted.count(identityOf(attrEntry))) {
+            stats.dedupeHits++;
+            return;
+        }
+
+        // Create an entry for the attribute if none exists.
+        auto entry = valueMap.find(attrEntry);
+        if (entry == valueMap.end()) {
+            attrEntry.id = ++nextId;
+            entries.fetch_add(1, std::memory_order_relaxed);
+            curAttrPath.push_back(attrEntry);
+            auto path = attrPathToPath(curAttrPath);
+            // std::cout << "valueMap - inserting: " << attrPathJoin(path)
+            //           << std::endl;
+            valueMap.emplace(attrEntry, ValueIntrospection(path));
+            entry = valueMap.find(attrEntry);
+        } else {
+            attrEntry.id = entry->first.id;
+            curAttrPath.push_back(attrEntry);
+        }
+        if (progress.wantsPath()) {
+            progress.setPath(attrPathJoin(curAttrPath));
+        }
+
+        // Important: Use this only as a key to find the actual parent in
+        // the map
+        auto parentAttrsKey = AttrEntry(parentValue);
+        auto parent = valueMap.find(parentAttrsKey);
+
+        if (parent != valueMap.end() && entry != valueMap.end()) {
+            // std::cout << "adding: " << entry->first
+            //           << " as child to: " << parent->first << std::endl;
+            parent->second.children.emplace(name, entry->first);
+        }
+
+        // Skip value if exists and is already analyzed
+        if (entry != valueMap.end() && entry->second.isIntrospected) {
+            // std::cout << "SKIPPING: " << attrEntry << " already analyzed
+            // - "
+            //           << entry->second << std::endl;
+            // Important!: Add the attrName and link it to the already
+            // analyzed value
+            valueMap.emplace(attrEntry, entry->second);
+            stats.dedupeHits++;
+            return;
+        }
+
+        const auto visit = [&]() {
+            // Same definition as for the canonical system. Neither
+            // introspected nor written, its parent still lists it as child.
+            if (isSystemCopy(curAttrPath)) {
+                printMsg(lvlDebug, "same as on %s: %s", canonicalSystem,
+                         attrPathJoin(curAttrPath));
+                stats.systemCopiesSkipped++;
+                valueMap.erase(attrEntry);
+                return;
+            }
+
+            openEntries.push_back(attrEntry);
+            introspectValue(curAttrPath, childValue);
+
+            // If value is an attrset recurse further into tree
+            nix::Value *value = childValue;
+            try {
+                state->forceValue(*value, noPos);
+                if (value->type() == nAttrs) {
+                    bool recurse = true;
+                    Attr *drvPath =
+                        value->attrs->get(state->symbols.create("drvPath"));
+                    if (drvPath != nullptr) {
+                        // Check if drvPath is a string/path and has
+                        // context.
+                        try {
+
+                            state->forceString(
+                                *drvPath->value, drvPath->pos,
+                                "error drvPath is not a string");
+                        } catch (nix::Error &e) {
+                            std::cout << "drvPath is not a string"
+                                      << std::endl;
+                        }
+
+                        auto context = drvPath->value->string.context;
+                        if (context != nullptr) {
+                            std::cout << "Skipping recursing derivation: "
+                                      << name << std::endl;
+                            stats.derivationsSkipped++;
+                            recurse = false;
+                        }
+                    }
+                    if (startsWithDoubleUnderscore(name)) {
+                        recurse = false;
+                        std::cout << "Skipping recursing intern attribute: "
+                                  << name << std::endl;
+                    }
+
+                    // Dont recurse into derivations? Since they are
+                    // attribute sets from a language perspective. { drvPath
+                    // = "/nix/store/..."; <-context }
+                    // But they are "derivations" from a user perspective.
+                    if (recurse == true) {
+                        recurseValues(curAttrPath, value);
+                    }
+                } else if (value->type() == nList && config.traverseLists) {
+                    recurseList(curAttrPath, value);
+                }
+                summarizeElements(attrEntry, value);
+            } catch (nix::Error &e) {
+            }
+
+            // The subtree is done, nothing will change this record
+            // anymore.
+            openEntries.pop_back();
+            emit(attrEntry);
+        };
+
+        // Every top-level subtree runs on its own stack. A runaway
+        // recursion then only costs that subtree, not the whole run.
+        if (attrPath.size() == 1) {
+            std::set<std::string> files;
+            runIsolated(attrEntry, [&]() {
+                std::optional<DependencyScope> scope;
+                if (trackDeps) {
+                    scope.emplace(files);
+                }
+                visit();
+            });
+            // A stack overflow leaves the interrupted entries open.
+            while (!openEntries.empty()) {
+                emit(openEntries.back());
+                openEntries.pop_back();
+            }
+            if (trackDeps) {
+                deps.attrs[name] = std::move(files);
+                deps.order.push_back(name);
+            }
+
+            checkpoint.done.insert(name);
+            auto elapsed = std::chrono::steady_clock::now() - lastCheckpoint;
+            auto interval = std::chrono::seconds(config.checkpointInterval);
+            if (checkpointDir && elapsed >= interval) {
+                saveCheckpoint();
+            }
+        } else {
+            visit();
+        }
+    };
+
+    const auto limitReached = [&]() {
+        if (entries.load(std::memory_order_relaxed) <= maxEntries) {
+            return false;
+        }
+        std::cout << "STOP: more than " << maxEntries
+                  << " entries introspected." << std::endl;
+        return true;
+    };
+
+    // Whether the attribute or list element 'name' below 'attrPath' belongs
+    // to another shard.
+    const auto inOtherShard = [&](const std::vector<AttrEntry> &attrPath,
+                                  const std::string &name) {
+        if (attrPath.size() != config.shardDepth) {
+            return false;
+        }
+        auto path = attrPathToPath(attrPath);
+        path.erase(path.begin());
+        path.push_back(name);
+        return !inShard(path, config);
+    };
+
+    // Recurse into test attrset
     recurseValues = [&](std::vector<AttrEntry> attrPath,
                         nix::Value *testAttrs) -> void {
-        if (valueMap.size() > 500) {
-            std::cout << "STOP: valueMap size > 5000." << std::endl;
+        if (limitReached()) {
+            return;
+        }
+
+        if (worker && attrPath.size() == 1) {
+            // Sampling and sharding were applied when the queue was filled.
+            while (!overflowedIn) {
+                auto name = worker->jobs.pop(worker->index);
+                if (!name) {
+                    break;
+                }
+                progress.take();
+                Attr *i = testAttrs->attrs->get(state->symbols.create(*name));
+                if (i == nullptr) {
+                    continue;
+                }
+                printMsg(lvlDebug, "worker %d looking into symbol: %s",
+                         worker->index, *name);
+                visitChild(attrPath,
+                           AttrEntry(i->value, *name, state->positions[i->pos]),
+                           testAttrs);
+            }
             return;
         }
 
-        for (auto &i : testAttrs->attrs->lexicographicOrder(state->symbols)) {
+        auto sorted = testAttrs->attrs->lexicographicOrder(state->symbols);
+        auto indices = sampleIndices(sorted.size(), config);
+        if (config.dedupeSystems) {
+            // The other systems are compared against the canonical one.
+            std::stable_partition(
+                indices.begin(), indices.end(), [&](size_t index) {
+                    return state->symbols[sorted[index]->name] ==
+                           canonicalSystem;
+                });
+        }
+        progress.discover(indices.size());
+        for (size_t index : indices) {
+            progress.take();
+            if (overflowedIn) {
+                continue;
+            }
+            auto &i = sorted[index];
             // might not have a name, if its the root attrset;
             // value: testAttrs
 
             const std::string &name = state->symbols[i->name];
             Pos currPos = state->positions[i->pos];
+
+            if (attrPath.size() == 1 && checkpoint.done.count(name)) {
+                std::cout << "Skipping resumed attribute: " << name
+                          << std::endl;
+                continue;
+            }
+            if (attrPath.size() == 1 && reusable.count(name)) {
+                std::cout << "Reusing previous result for: " << name
+                          << std::endl;
+                reused.insert(name);
+                deps.order.push_back(name);
+                continue;
+            }
+            if (inOtherShard(attrPath, name)) {
+                continue;
+            }
             std::cout << "looking into symbol: " << name << std::endl;
 
-            // Copy and append current attribute
-            std::vector<AttrEntry> curAttrPath = attrPath;
+            visitChild(attrPath, AttrEntry(i->value, name, currPos),
+                       testAttrs);
+        }
+    };
 
-            const auto attrEntry = AttrEntry(i->value, name, currPos);
-            curAttrPath.push_back(attrEntry);
-            auto path = attrPathToPath(curAttrPath);
+    // Recurse into the (sampled) elements of a list
+    recurseList = [&](std::vector<AttrEntry> attrPath,
+                      nix::Value *list) -> void {
+        if (limitReached()) {
+            return;
+        }
 
-            // Create an entry for the attribute if none exists.
-            auto entry = valueMap.find(attrEntry);
-            if (entry == valueMap.end()) {
-                // std::cout << "valueMap - inserting: " << attrPathJoin(path)
-                //           << std::endl;
-                valueMap.emplace(attrEntry, ValueIntrospection(path));
-                entry = valueMap.find(attrEntry);
+        auto elems = list->listElems();
+        auto indices = sampleIndices(list->listSize(), config);
+        progress.discover(indices.size());
+        for (size_t index : indices) {
+            progress.take();
+            auto name = elementName(index);
+            if (inOtherShard(attrPath, name)) {
+                continue;
             }
+            visitChild(attrPath, AttrEntry(elems[index], name, {}), list);
+        }
+    };
 
-            // Important: Use this only as a key to find the actual parent in
-            // the map
-            auto parentAttrsKey = AttrEntry(testAttrs);
-            auto parent = valueMap.find(parentAttrsKey);
+    std::string filename = config.outFile; // Name of the file to create/write
+
+    // Write to a temporary file and rename it, so that readers never see a
+    // partially written output.
+    std::string tmpFilename = filename + ".tmp";
+    std::exception_ptr writerError;
+    // Only touched by the writer until it is joined.
+    RunStats writerStats;
+    std::thread writer([&]() {
+        if (worker) {
+            // Value pointers are only meaningful to this worker's EvalState.
+            while (auto record = records.pop()) {
+                releaseValues(*record);
+                worker->records.push_back(std::move(*record));
+            }
+            return;
+        }
+        try {
+            auto sink = openOutput(tmpFilename, config);
+            bool ndjson = config.format == "ndjson";
+            JsonWriter out(*sink, config.compact || ndjson ? 0 : 4);
+            // Comments are looked up here, so that reading the sources
+            // overlaps the evaluation.
+            DocComments docs;
+            DocComments *withDocs = config.docComments ? &docs : nullptr;
+            // NDJSON has one record per line instead of a surrounding array
+            const auto endRecord = [&]() {
+                if (ndjson) {
+                    out.lineBreak();
+                }
+            };
+
+            // With config.sorted, everything is held back and written by
+            // attribute path at the end.
+            std::vector<OutputRecord> held;
+            std::vector<const json *> carried;
+            const auto writeCarried = [&](const json &record) {
+                if (config.sorted) {
+                    carried.push_back(&record);
+                    return;
+                }
+                writeJsonValue(out, record);
+                endRecord();
+            };
 
-            if (parent != valueMap.end() && entry != valueMap.end()) {
-                // std::cout << "adding: " << entry->first
-                //           << " as child to: " << parent->first << std::endl;
-                parent->second.children.emplace(name, entry->first);
+            if (!ndjson) {
+                out.beginArray();
+            }
+            // Only measured with --stats, the clock is read twice per
+            // record.
+            std::chrono::steady_clock::duration writing{0};
+            while (auto record = records.pop()) {
+                if (config.sorted) {
+                    held.push_back(std::move(*record));
+                    continue;
+                }
+                if (!config.stats) {
+                    writeRecord(out, record->binding, record->value,
+                                withDocs);
+                    endRecord();
+                    continue;
+                }
+                auto start = std::chrono::steady_clock::now();
+                writeRecord(out, record->binding, record->value, withDocs);
+                endRecord();
+                writing += std::chrono::steady_clock::now() - start;
             }
+            writerStats.phases["serialization"] += writing;
+            // Everything from here on happens after the traversal.
+            PhaseTimer timer(writerStats, "serialization");
+            // Records carried over from a checkpoint or a previous run.
+            // 'reused' is final once the queue is closed.
+            for (auto &record : checkpoint.records) {
+                writeCarried(record);
+            }
+            for (const auto &record : previousRecords) {
+                auto &path = record.at("value").at("path");
+                if (path.size() >= 2 &&
+                    reused.count(path[1].get<std::string>())) {
+                    writeCarried(record);
+                }
+            }
+            if (config.sorted) {
+                // Indices into 'held', followed by those into 'carried'.
+                std::vector<std::pair<std::vector<std::string>, size_t>> order;
+                order.reserve(held.size() + carried.size());
+                for (size_t n = 0; n < held.size(); n++) {
+                    order.emplace_back(held[n].value.path, n);
+                }
+                for (size_t n = 0; n < carried.size(); n++) {
+                    order.emplace_back(carried[n]
+                                           ->at("value")
+                                           .at("path")
+                                           .get<std::vector<std::string>>(),
+                                       held.size() + n);
+                }
+                std::sort(order.begin(), order.end());
+                for (auto &[path, n] : order) {
+                    if (n < held.size()) {
+                        writeRecord(out, held[n].binding, held[n].value,
+                                    withDocs);
+                    } else {
+                        writeJsonValue(out, *carried[n - held.size()]);
+                    }
+                    endRecord();
+                }
+            }
+            if (!ndjson) {
+                out.endArray();
+            }
+            out.flush();
+            sink->finish();
+        } catch (...) {
+            writerError = std::current_exception();
+            // Keep draining, the evaluation must not block on a dead writer.
+            while (records.pop()) {
+            }
+        }
+    });
+
+    try {
+        PhaseTimer timer(stats, "traversal");
+        if (reportsRoot) {
+            stats.nodesVisited++;
+            progress.visit();
+            entries.fetch_add(1, std::memory_order_relaxed);
+        }
+        auto posIdx = vRoot->attrs->pos;
+
+        auto rootKey = AttrEntry(vRoot, "<root>", state->positions[posIdx]);
+        rootKey.isRoot = true;
+        rootKey.id = ++nextId;
+
+        auto initPath = std::vector<AttrEntry>({rootKey});
+        valueMap.emplace(rootKey, ValueIntrospection({"<root>"}));
+        runIsolated(rootKey, [&]() {
+            std::optional<DependencyScope> scope;
+            if (trackDeps) {
+                scope.emplace(deps.root);
+            }
+            introspectValue(initPath, vRoot);
+        });
+        std::cout << "Root introspection done" << std::endl;
+        recurseValues(initPath, vRoot);
+        summarizeElements(rootKey, vRoot);
+        if (reportsRoot) {
+            emit(rootKey);
+        }
+    } catch (...) {
+        records.close();
+        writer.join();
+        throw;
+    }
+
+    records.close();
+    writer.join();
+    if (writerError) {
+        std::rethrow_exception(writerError);
+    }
+    stats.merge(writerStats);
+    // Everything up to the overflow is written (or handed to the caller),
+    // but the EvalState must not be used for another pass.
+    const auto throwIfOverflowed = [&]() {
+        if (overflowedIn) {
+            throw StackOverflowError(
+                "stack overflow while introspecting '%s', the remaining "
+                "attributes were skipped. Lower max-call-depth or raise "
+                "--stack-size",
+                *overflowedIn);
+        }
+    };
+    if (worker) {
+        throwIfOverflowed();
+        return;
+    }
 
-            // Skip value if exists and is already analyzed
-            if (entry != valueMap.end() && entry->second.isIntrospected) {
-                // std::cout << "SKIPPING: " << attrEntry << " already analyzed
-                // - "
-                //           << entry->second << std::endl;
-                // Important!: Add the attrName and link it to the already
-                // analyzed value
-                valueMap.emplace(attrEntry, entry->second);
+    auto writeStart = std::chrono::steady_clock::now();
+    std::filesystem::rename(tmpFilename, filename);
+    std::cout << "Success: Value introspection written to: " << filename
+              << std::endl;
+    writeIndexes(filename, config);
+    if (config.dedupeSystems) {
+        std::cout << stats.systemCopiesSkipped
+                  << " definitions skipped, same as on " << canonicalSystem
+                  << std::endl;
+    }
+
+    if (config.errorTable) {
+        auto errorFile = errorFileFor(filename);
+        errors.write(errorFile);
+        std::cout << errors.size() << " distinct errors written to: "
+                  << errorFile << std::endl;
+    }
+
+    if (config.shapes) {
+        auto shapeFile = shapeFileFor(filename);
+        shapes.write(shapeFile);
+        std::cout << shapes.size() << " shapes written to: " << shapeFile
+                  << std::endl;
+    }
+
+    if (trackDeps) {
+        for (auto &name : reused) {
+            deps.attrs[name] = previousDeps.attrs[name];
+        }
+        std::set<std::string> files = deps.root;
+        for (auto &[name, attrFiles] : deps.attrs) {
+            files.insert(attrFiles.begin(), attrFiles.end());
+        }
+        for (auto &file : files) {
+            deps.fingerprints[file] = fileFingerprint(file);
+        }
+        auto depsFile = dependencyFileFor(filename);
+        writeDependencies(depsFile, deps);
+        std::cout << "Dependencies written to: " << depsFile << std::endl;
+    }
+    stats.phases["write"] += std::chrono::steady_clock::now() - writeStart;
+    writeRunStats(stats, filename, config);
+    throwIfOverflowed();
+}
+
+// Introspect the top-level attributes on config.nrWorkers threads inside
+// this process. Every worker has its own EvalState, the workers share the
+// store. Values reachable from several top-level attributes are introspected
+// by each worker that gets there.
+static void analyzeParallel(MixEvalArgs &args, ref<EvalState> state,
+                            Bindings &autoArgs, flutsch::Config const &config,
+                            Progress &progress) {
+    size_t workers = config.nrWorkers;
+    WorkStealingQueue<std::string> jobs(workers);
+    RunStats stats;
+    {
+        PhaseTimer timer(stats, "root_eval");
+        nix::Value *vRoot = rootValue(state, autoArgs, config);
+        if (vRoot->type() != nAttrs) {
+            throw EvalError("Top level attribute is not an attrset");
+        }
+        auto sorted = vRoot->attrs->lexicographicOrder(state->symbols);
+        for (size_t index : sampleIndices(sorted.size(), config)) {
+            std::string name = state->symbols[sorted[index]->name];
+            if (config.shardDepth == 1 && !inShard({name}, config)) {
                 continue;
             }
+            jobs.push(name);
+            progress.discover(1);
+        }
+    }
 
-            introspectValue(curAttrPath, i->value);
+    std::vector<std::vector<OutputRecord>> results(workers);
+    std::vector<RunStats> workerStats(workers);
+    std::vector<std::exception_ptr> failures(workers);
+    std::atomic<uint64_t> entries{0};
+    // Opening an EvalState and parsing --arg are not meant to run
+    // concurrently.
+    std::mutex setup;
+    std::vector<std::thread> threads;
+    for (size_t n = 0; n < workers; n++) {
+        threads.emplace_back([&, n]() {
+            GcThread gc;
+            try {
+                Worker worker{n, jobs, results[n], workerStats[n], entries};
+                // Worker 0 reuses the root evaluated above.
+                if (n == 0) {
+                    analyze(state, autoArgs, config, progress, &worker);
+                    return;
+                }
+                std::optional<ref<EvalState>> own;
+                Bindings *ownArgs;
+                {
+                    std::lock_guard lock(setup);
+                    own = ref<EvalState>(std::make_shared<EvalState>(
+                        args.searchPath, state->store));
+                    ownArgs = args.getAutoArgs(**own);
+                }
+                analyze(*own, *ownArgs, config, progress, &worker);
+            } catch (...) {
+                failures[n] = std::current_exception();
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    // A stack overflow only ruins the EvalState of its worker, the
+    // records of all workers are still written.
+    std::exception_ptr overflow;
+    for (auto &failure : failures) {
+        if (!failure) {
+            continue;
+        }
+        try {
+            std::rethrow_exception(failure);
+        } catch (StackOverflowError &) {
+            overflow = failure;
+        }
+    }
+    for (auto &other : workerStats) {
+        stats.merge(other);
+    }
 
-            // If value is an attrset recurse further into tree
-            {
-                nix::Value *value = i->value;
-                try {
-                    state->forceValue(*value, noPos);
-                    if (value->type() == nAttrs) {
-                        bool recurse = true;
-                        Attr *drvPath =
-                            value->attrs->get(state->symbols.create("drvPath"));
-                        if (drvPath != nullptr) {
-                            // Check if drvPath is a string/path and has
-                            // context.
-                            try {
+    std::string filename = config.outFile;
+    std::string tmpFilename = filename + ".tmp";
+    std::optional<PhaseTimer> serialization;
+    serialization.emplace(stats, "serialization");
+    auto sink = openOutput(tmpFilename, config);
+    bool ndjson = config.format == "ndjson";
+    JsonWriter out(*sink, config.compact || ndjson ? 0 : 4);
+    if (!ndjson) {
+        out.beginArray();
+    }
+    DocComments docs;
+    DocComments *withDocs = config.docComments ? &docs : nullptr;
+    std::vector<const OutputRecord *> all;
+    for (auto &records : results) {
+        for (auto &record : records) {
+            all.push_back(&record);
+        }
+    }
+    if (config.sorted) {
+        std::stable_sort(all.begin(), all.end(), [](auto a, auto b) {
+            return a->value.path < b->value.path;
+        });
+    }
+    size_t written = 0;
+    for (auto record : all) {
+        writeRecord(out, record->binding, record->value, withDocs);
+        if (ndjson) {
+            out.lineBreak();
+        }
+        written++;
+    }
+    if (!ndjson) {
+        out.endArray();
+    }
+    out.flush();
+    sink->finish();
+    serialization.reset();
+
+    auto writeStart = std::chrono::steady_clock::now();
+    std::filesystem::rename(tmpFilename, filename);
+    std::cout << "Success: " << written << " records of " << workers
+              << " workers written to: " << filename << std::endl;
+    writeIndexes(filename, config);
+    stats.phases["write"] += std::chrono::steady_clock::now() - writeStart;
+    writeRunStats(stats, filename, config);
+    if (overflow) {
+        std::rethrow_exception(overflow);
+    }
+}
 
-                                state->forceString(
-                                    *drvPath->value, drvPath->pos,
-                                    "error drvPath is not a string");
-                            } catch (nix::Error &e) {
-                                std::cout << "drvPath is not a string"
-                                          << std::endl;
-                            }
+// Walk a flake through the evaluation cache of Nix. For a locked flake that
+// was analyzed before, attribute names, most value types and whether an
+// attrset is a derivation come from the cache. Only values the cache does
+// not describe, like functions, are evaluated. The cache has no source
+// positions, so only those of evaluated functions are known.
+static void analyzeCached(ref<EvalState> state, flutsch::Config const &config,
+                          Progress &progress) {
+    auto [flakeRef, fragment, outputSpec] =
+        parseFlakeRefWithFragmentAndExtendedOutputsSpec(config.releaseExpr,
+                                                        absPath("."));
+    InstallableFlake flake{
+        {}, state, std::move(flakeRef), fragment, outputSpec,
+        {}, {},    config.lockFlags};
+    RunStats stats;
+    auto root = [&]() {
+        PhaseTimer timer(stats, "root_eval");
+        return flake.getCursor(*state);
+    }();
 
-                            auto context = drvPath->value->string.context;
-                            if (context != nullptr) {
-                                std::cout
-                                    << "Skipping recursing derivation: " << name
-                                    << std::endl;
-                                recurse = false;
-                            }
-                        }
-                        if (startsWithDoubleUnderscore(name)) {
-                            recurse = false;
-                            std::cout << "Skipping recursing intern attribute: "
-                                      << name << std::endl;
-                        }
+    std::string filename = config.outFile;
+    std::string tmpFilename = filename + ".tmp";
+    auto sink = openOutput(tmpFilename, config);
+    bool ndjson = config.format == "ndjson";
+    JsonWriter out(*sink, config.compact || ndjson ? 0 : 4);
+    if (!ndjson) {
+        out.beginArray();
+    }
+    DocComments docs;
+    DocComments *withDocs = config.docComments ? &docs : nullptr;
+    size_t written = 0;
 
-                        // Dont recurse into derivations? Since they are
-                        // attribute sets from a language perspective. { drvPath
-                        // = "/nix/store/..."; <-context }
-                        // But they are "derivations" from a user perspective.
-                        if (recurse == true) {
-                            recurseValues(curAttrPath, value);
-                        }
+    Symbol sFunctor = state->symbols.create("__functor");
+
+    uint64_t entries = 0;
+    // Like in analyze, the EvalState is unusable after a stack overflow.
+    std::optional<std::string> overflowedIn;
+    // Records of the top-level subtree that is currently introspected on
+    // its own stack. They are only written once it is done, so that a stack
+    // overflow cannot leave a half written record behind.
+    std::vector<OutputRecord> *pending = nullptr;
+
+    const auto writeCached = [&](const AttrEntry &binding,
+                                 const ValueIntrospection &value) {
+        PhaseTimer timer(stats, "serialization");
+        writeRecord(out, binding, value, withDocs);
+        if (ndjson) {
+            out.lineBreak();
+        }
+        written++;
+    };
+
+    // Type of a value that is not an attrset, from the cache if possible.
+    const auto cachedType = [&](eval_cache::AttrCursor &cursor,
+                                ValueIntrospection &value) {
+        try {
+            cursor.getString();
+            // Paths are cached as strings, too.
+            value.valueType = "string";
+            return;
+        } catch (TypeError &e) {
+        }
+        try {
+            cursor.getBool();
+            value.valueType = "bool";
+            return;
+        } catch (TypeError &e) {
+        }
+        try {
+            value.count = cursor.getListOfStrings().size();
+            value.valueType = "list";
+            return;
+        } catch (TypeError &e) {
+        }
+
+        // Evaluate it
+        stats.valuesForced++;
+        Value &v = cursor.forceValue();
+        value.valueType = valueTypeName(v);
+        if (v.isLambda()) {
+            if (auto p = getPos(state, v.lambda.fun->getPos())) {
+                value.valuePos.emplace(*p);
+            }
+            std::optional<std::unordered_map<uint, LambdaIntrospection>>
+                staticMeta;
+            if (config.staticLambdas) {
+                staticMeta = staticUnwrapLambda(*v.lambda.fun, state);
+            }
+            value.lambdaIntrospections =
+                staticMeta ? *staticMeta : unwrapLambda(v, state);
+            stats.addUnwrap(value.lambdaIntrospections->size(), false);
+        }
+    };
+
+    std::function<void(ref<eval_cache::AttrCursor>, const AttrEntry &,
+                       std::vector<std::string>)>
+        visit;
+    visit = [&](ref<eval_cache::AttrCursor> cursor, const AttrEntry &binding,
+                std::vector<std::string> path) {
+        entries++;
+        stats.nodesVisited++;
+        progress.visit();
+        if (progress.wantsPath()) {
+            progress.setPath(attrPathJoin(path));
+        }
+        ValueIntrospection value(path);
+        std::vector<std::string> recurse;
+        try {
+            std::optional<std::vector<Symbol>> attrs;
+            try {
+                attrs = cursor->getAttrs();
+            } catch (TypeError &e) {
+            }
+
+            if (attrs) {
+                value.valueType = "attrset";
+                if (std::find(attrs->begin(), attrs->end(), sFunctor) !=
+                    attrs->end()) {
+                    value.valueType = "attrset/functor";
+                    stats.valuesForced++;
+                    value.lambdaIntrospections =
+                        unwrapLambda(cursor->forceValue(), state);
+                    stats.addUnwrap(value.lambdaIntrospections->size(), true);
+                }
+                auto indices = sampleIndices(attrs->size(), config);
+                if (indices.size() < attrs->size()) {
+                    value.count = attrs->size();
+                    value.sampled = true;
+                }
+                bool isDrv = cursor->isDerivation();
+                if (isDrv) {
+                    stats.derivationsSkipped++;
+                }
+                // Without forcing the attrset, shared attrsets and cycles
+                // like pkgs.pkgs cannot be recognized. They are bounded by
+                // the depth and maxEntries instead.
+                bool descend =
+                    !startsWithDoubleUnderscore(binding.name.value_or("")) &&
+                    !isDrv && path.size() <= config.evalCacheDepth;
+                for (size_t index : indices) {
+                    std::string name = state->symbols[(*attrs)[index]];
+                    value.children.emplace(name, AttrEntry(nullptr, name, {}));
+                    if (descend) {
+                        recurse.push_back(name);
                     }
-                } catch (nix::Error &e) {
                 }
+            } else {
+                cachedType(*cursor, value);
             }
+        } catch (nix::Error &e) {
+            auto &kind = classifyError(e);
+            stats.errors[kind.name]++;
+            progress.fail();
+            value.isError = true;
+            value.valueType = kind.name;
+            value.errorDescription = errorMessage(e, kind);
         }
-    };
+        value.isIntrospected = true;
 
-    auto posIdx = vRoot->attrs->pos;
+        if (!recurse.empty() && entries > maxEntries) {
+            std::cout << "STOP: more than " << maxEntries
+                      << " entries introspected." << std::endl;
+            recurse.clear();
+        }
+        progress.discover(recurse.size());
+        for (auto &name : recurse) {
+            progress.take();
+            if (overflowedIn) {
+                continue;
+            }
+            auto childPath = path;
+            childPath.push_back(name);
+            if (path.size() == config.shardDepth &&
+                !inShard(std::vector<std::string>(childPath.begin() + 1,
+                                                  childPath.end()),
+                         config)) {
+                continue;
+            }
+            AttrEntry child(nullptr, name, {});
+            if (path.size() > 1 || config.stackSize == 0) {
+                visit(cursor->getAttr(name), child, childPath);
+                continue;
+            }
+
+            // Every top-level subtree runs on its own stack, see analyze.
+            auto records = std::make_unique<std::vector<OutputRecord>>();
+            pending = records.get();
+            auto result = runOnLargeStack(
+                config.stackSize * 1024 * 1024,
+                [&]() { visit(cursor->getAttr(name), child, childPath); });
+            pending = nullptr;
+            if (result == IsolationResult::StackOverflow) {
+                // The records may be inconsistent, they are leaked.
+                records.release();
+                std::cout << "stack overflow while introspecting: " << name
+                          << std::endl;
+                stats.errors["StackOverflow"]++;
+                progress.fail();
+                overflowedIn = name;
+                ValueIntrospection overflow(childPath);
+                overflow.isError = true;
+                overflow.isIntrospected = true;
+                overflow.valueType = "StackOverflow";
+                overflow.errorDescription =
+                    "stack overflow (possible infinite recursion)";
+                writeCached(child, overflow);
+                continue;
+            }
+            for (auto &record : *records) {
+                writeCached(record.binding, record.value);
+            }
+        }
+
+        if (pending) {
+            pending->push_back({binding, std::move(value)});
+        } else {
+            writeCached(binding, value);
+        }
+    };
 
-    auto rootKey = AttrEntry(vRoot, "<root>", state->positions[posIdx]);
+    auto rootKey = AttrEntry(nullptr, "<root>", {});
     rootKey.isRoot = true;
+    {
+        PhaseTimer timer(stats, "traversal");
+        visit(root, rootKey, {"<root>"});
+    }
+
+    {
+        PhaseTimer timer(stats, "serialization");
+        if (!ndjson) {
+            out.endArray();
+        }
+        out.flush();
+        sink->finish();
+    }
 
-    auto initPath = std::vector<AttrEntry>({rootKey});
-    valueMap.emplace(rootKey, ValueIntrospection({"<root>"}));
-    introspectValue(initPath, vRoot);
-    std::cout << "Root introspection done" << std::endl;
-    recurseValues(initPath, vRoot);
-
-    // std::cout << "\n---\nValueMap: \n";
-    // displayValueMap(valueMap);
-    // std::cout << "---\n";
-    // create an empty list []
-
-    // Some pretty printing.
-    json out = json::array({});
-    for (auto pair : valueMap) {
-        out.push_back({
-            // Infos from ValueIntrospection
-            {"value",
-             {{"path", pair.second.path},
-              {"pos", posToJson(pair.second.valuePos)},
-              {"children", childrenToJson(pair.second.children)},
-              {"type", pair.second.valueType},
-              {"error", pair.second.isError},
-              {"error_description", pair.second.errorDescription},
-              {"lambda", lambdaMapToJson(pair.second.lambdaIntrospections)}}},
-            // Infos from AttrEntry
-            {"binding",
-             {{"pos", posToJson(pair.first.bindPos)},
-              {"name", pair.first.name},
-              {"is_root", pair.first.isRoot}}},
+    auto writeStart = std::chrono::steady_clock::now();
+    std::filesystem::rename(tmpFilename, filename);
+    std::cout << "Success: " << written
+              << " cached value introspections written to: " << filename
+              << std::endl;
+    writeIndexes(filename, config);
+    stats.phases["write"] += std::chrono::steady_clock::now() - writeStart;
+    writeRunStats(stats, filename, config);
+    if (overflowedIn) {
+        throw StackOverflowError(
+            "stack overflow while introspecting '%s', the remaining "
+            "attributes were skipped. Lower max-call-depth or raise "
+            "--stack-size",
+            *overflowedIn);
+    }
+}
 
+// Output file of batch job 'n' if it has no "out", e.g. values-3.ndjson.zst
+static std::string batchOutFile(size_t n, flutsch::Config const &config) {
+    std::string name = "values-" + std::to_string(n) + "." + config.format;
+    if (config.zstd) {
+        name += ".zst";
+    }
+    return name;
+}
+
+// Run every job of a JSONL stream with the same EvalState, so that files
+// shared between the jobs are only parsed and evaluated once.
+// A job looks like {"expr": "./default.nix", "out": "default.json"}, with
+// an optional "fromArgs" like the command line flag.
+static void analyzeBatch(ref<EvalState> state, Bindings &autoArgs,
+                         flutsch::Config const &config, std::istream &jobs,
+                         Progress &progress) {
+    std::string line;
+    size_t total = 0;
+    size_t failed = 0;
+    while (std::getline(jobs, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        total++;
+        flutsch::Config job = config;
+        try {
+            auto j = json::parse(line);
+            job.releaseExpr = j.at("expr").get<std::string>();
+            job.outFile = j.value("out", batchOutFile(total, config));
+            job.fromArgs = j.value("fromArgs", config.fromArgs);
+            std::cout << "Batch job " << total << ": " << job.releaseExpr
+                      << std::endl;
+            analyze(state, autoArgs, job, progress);
+        } catch (StackOverflowError &e) {
+            // The remaining jobs would run on a broken EvalState.
+            std::cerr << "Batch job " << total << " failed: " << e.what()
+                      << std::endl;
+            throw;
+        } catch (std::exception &e) {
+            // Covers nix::Error and malformed jobs. The next job may well
+            // succeed.
+            failed++;
+            std::cerr << "Batch job " << total << " failed: " << e.what()
+                      << std::endl;
+        }
+    }
+    std::cout << "Batch done: " << total - failed << " of " << total
+              << " jobs succeeded" << std::endl;
+    if (failed > 0) {
+        throw Error("%d of %d batch jobs failed", failed, total);
+    }
+}
+
+// Keep the EvalState alive and re-analyze whenever a file the output
+// depends on changes. Only the affected top-level attributes are
+// introspected again, everything else is taken from the previous output.
+static void watchAndAnalyze(ref<EvalState> state, Bindings &autoArgs,
+                            flutsch::Config const &config,
+                            Progress &progress) {
+    flutsch::Config first = config;
+    first.trackDependencies = true;
+    analyze(state, autoArgs, first, progress);
+
+    FileWatcher watcher;
+    // Changes that have not made it into a successful pass yet.
+    std::set<std::string> pending;
+    while (true) {
+        auto deps = readDependencies(dependencyFileFor(config.outFile));
+        std::set<std::string> files = deps.root;
+        for (auto &[name, attrFiles] : deps.attrs) {
+            files.insert(attrFiles.begin(), attrFiles.end());
+        }
+        // Store paths are immutable.
+        std::erase_if(files, [&](const std::string &file) {
+            return state->store->isInStore(file);
         });
+        watcher.watch(files);
+        std::cout << "Watching " << files.size() << " files for changes"
+                  << std::endl;
+
+        auto changed = watcher.waitForChanges();
+        pending.insert(changed.begin(), changed.end());
+        for (auto &file : changed) {
+            std::cout << "Changed: " << file << std::endl;
+        }
+
+        // Otherwise evalFile would hand out the old results.
+        state->resetFileCache();
+
+        flutsch::Config pass = config;
+        pass.trackDependencies = true;
+        pass.previousOutput = config.outFile;
+        pass.changedFiles.assign(pending.begin(), pending.end());
+        try {
+            analyze(state, autoArgs, pass, progress);
+            pending.clear();
+        } catch (StackOverflowError &) {
+            // The EvalState cannot be reused.
+            throw;
+        } catch (nix::Error &e) {
+            // Most likely a file in the middle of being edited. Keep the
+            // previous output and wait for the next change.
+            std::cerr << e.msg() << std::endl;
+        } catch (std::exception &e) {
+            // e.g. a filesystem error while writing the output
+            std::cerr << e.what() << std::endl;
+        }
     }
+}
 
-    // std::string pretty = out.dump(4);
-    // std::cout << pretty << std::endl;
+void getPositions(MixEvalArgs &args, flutsch::Config const &config) {
+    std::cout << "positionsEval" << std::endl;
 
-    std::string filename = "values.json"; // Name of the file to create/write
+    // Before any worker or isolated stack registers with the GC.
+    allowGcThreads();
+
+    auto state = ref<EvalState>(std::make_shared<EvalState>(
+        args.searchPath, openStore(*args.evalStoreUrl)));
+    Bindings &autoArgs = *args.getAutoArgs(*state);
 
-    // Open the file in write mode. This will create the file if it doesn't
-    // exist, or overwrite it if it does.
-    std::ofstream file(filename);
+    if (config.trackDependencies || config.previousOutput || config.watch) {
+        trackImports(*state);
+    }
 
-    if (!file.is_open()) {
-        std::cerr << "Failed to open or create file." << filename << std::endl;
+    // Counted in any case, only reported with config.progress.
+    Progress progress;
+    std::optional<ProgressReporter> reporter;
+    if (config.progress) {
+        reporter.emplace(progress);
     }
 
-    // Write the string to the file
-    file << out.dump(4);
-    file.close();
-    std::cout << "Success: Value introspection written to: " << filename
-              << std::endl;
+    if (config.batch) {
+        analyzeBatch(state, autoArgs, config, std::cin, progress);
+    } else if (config.watch) {
+        watchAndAnalyze(state, autoArgs, config, progress);
+    } else if (config.flake && config.evalCache) {
+        analyzeCached(state, config, progress);
+    } else if (config.nrWorkers > 1) {
+        analyzeParallel(args, state, autoArgs, config, progress);
+    } else {
+        analyze(state, autoArgs, config, progress);
+    }
+    if (reporter) {
+        reporter->finish();
+    }
 }
 
 } // namespace flutsch
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include <nlohmann/json.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+namespace flutsch {
+
+// Progress of a traversal, persisted to disk so that an interrupted run can
+// be resumed with '--resume <dir>'.
+struct Checkpoint {
+    // The expression this checkpoint was created for.
+    std::string releaseExpr;
+    // Top-level attributes whose subtree has been fully introspected.
+    std::set<std::string> done;
+    // Output records of all finished subtrees.
+    nlohmann::json records = nlohmann::json::array();
+};
+
+// Writes a checkpoint to a directory incrementally. Records are appended to
+// a records file as they are finished, commit() makes everything appended
+// so far part of the checkpoint. A checkpoint is never rewritten as a
+// whole, so the cost of a commit does not grow with the run.
+class CheckpointWriter {
+  public:
+    // Start a new checkpoint in 'dir' (created if needed) that already
+    // holds everything in 'base', e.g. the checkpoint a run resumed from.
+    CheckpointWriter(const std::string &dir, const Checkpoint &base);
+    ~CheckpointWriter();
+
+    CheckpointWriter(const CheckpointWriter &) = delete;
+    CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+    // Append a single serialized record, without a line break.
+    void add(std::string_view record);
+
+    // Flush and fsync the appended records, then atomically replace the
+    // checkpoint state with 'done'.
+    void commit(const std::set<std::string> &done);
+
+  private:
+    void flush();
+
+    std::filesystem::path dir;
+    std::string releaseExpr;
+    uint64_t generation = 1;
+    int fd = -1;
+    std::string buffer;
+    // Bytes in the records file, including the buffer.
+    uint64_t size = 0;
+};
+
+// Read the checkpoint from 'dir', if there is one. Records appended after
+// the last commit are ignored.
+std::optional<Checkpoint> readCheckpoint(const std::string &dir);
+
+}; // namespace flutsch
+
+#endif // CHECKPOINT_H
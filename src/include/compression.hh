@@ -0,0 +1,43 @@
+#include <memory>
+#include <string>
+
+#include "json-writer.hh"
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+namespace flutsch {
+
+// Whether flutsch was built with zstd support.
+bool haveZstd();
+
+// Compresses everything written to it with zstd and passes it on to 'inner'.
+class ZstdSink : public OutputSink {
+  public:
+    // 'threads' > 0 compresses on that many additional worker threads.
+    ZstdSink(std::unique_ptr<OutputSink> inner, int level, int threads);
+    ~ZstdSink() override;
+
+    void write(const char *data, size_t len) override;
+    void finish() override;
+
+  private:
+    std::unique_ptr<OutputSink> inner;
+    void *cctx = nullptr;
+    std::string outBuf;
+};
+
+// Source of input that is read piece by piece.
+class InputSource {
+  public:
+    virtual ~InputSource() = default;
+    // Read up to 'len' bytes. Returns 0 at the end of the input.
+    virtual size_t read(char *data, size_t len) = 0;
+};
+
+// Open a file for streaming, decompressing it if it is zstd compressed.
+std::unique_ptr<InputSource> openInput(const std::string &path);
+
+}; // namespace flutsch
+
+#endif // COMPRESSION_H
@@ -0,0 +1,72 @@
+#include <nix/eval.hh>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifndef DEPS_H
+#define DEPS_H
+
+namespace flutsch {
+
+// Source files the evaluation of each top-level attribute has read.
+//
+// A value forced by one attribute (e.g. a shared 'lib') is not evaluated
+// again by the attributes after it, so their own files do not cover it. An
+// attribute therefore also depends on the files of every attribute
+// introspected before it, see reusableAttrs.
+struct DependencyInfo {
+    std::string releaseExpr;
+    // Files read while evaluating the root itself. A change to any of them
+    // invalidates every attribute.
+    std::set<std::string> root;
+    std::map<std::string, std::set<std::string>> attrs;
+    // The keys of 'attrs' in the order they were introspected.
+    std::vector<std::string> order;
+    // Content fingerprint of every file above, at the time of the run.
+    std::map<std::string, std::string> fingerprints;
+};
+
+// Collects every file that is imported or referenced by a source position on
+// the current thread, for as long as it is alive.
+class DependencyScope {
+  public:
+    explicit DependencyScope(std::set<std::string> &files);
+    ~DependencyScope();
+
+    DependencyScope(const DependencyScope &) = delete;
+    DependencyScope &operator=(const DependencyScope &) = delete;
+
+  private:
+    std::set<std::string> *previous;
+};
+
+// Report 'file' to the innermost DependencyScope of this thread, if any.
+void addDependency(const std::string &file);
+
+// Wrap 'import' of 'state' so that every imported file is reported via
+// addDependency. Must be called before anything is evaluated.
+void trackImports(nix::EvalState &state);
+
+// A cheap content fingerprint. Empty if the file cannot be read.
+std::string fileFingerprint(const std::string &file);
+
+// Files whose fingerprint differs from the recorded one.
+std::set<std::string> changedFiles(const DependencyInfo &info);
+
+// Top-level attributes that are not affected by a change to 'changed':
+// those introspected before the first attribute that has read a changed
+// file.
+std::set<std::string> reusableAttrs(const DependencyInfo &info,
+                                    const std::set<std::string> &changed);
+
+// The dependency file stored next to the output file 'output'.
+std::string dependencyFileFor(const std::string &output);
+
+void writeDependencies(const std::string &file, const DependencyInfo &info);
+
+DependencyInfo readDependencies(const std::string &file);
+
+}; // namespace flutsch
+
+#endif // DEPS_H
@@ -0,0 +1,28 @@
+#include <cstddef>
+#include <string>
+
+#include "flutsch.hh"
+
+#ifndef DIFF_H
+#define DIFF_H
+
+namespace flutsch {
+
+struct DiffSummary {
+    size_t added = 0;
+    size_t removed = 0;
+    size_t changed = 0;
+};
+
+// Compare two outputs that were written with --sorted, by a streaming merge
+// over their attribute paths. Every added, removed or changed record is
+// written to config.outFile as one line. Only the current record of each
+// input is held in memory. The ids of --shapes and --error-table are not
+// compared.
+DiffSummary diffOutputs(const std::string &oldPath,
+                        const std::string &newPath,
+                        flutsch::Config const &config);
+
+}; // namespace flutsch
+
+#endif // DIFF_H
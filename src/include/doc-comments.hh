@@ -0,0 +1,54 @@
+#include <nix/position.hh>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "mapped-file.hh"
+
+#ifndef DOC_COMMENTS_H
+#define DOC_COMMENTS_H
+
+namespace flutsch {
+
+// The comment directly in front of 'offset' in 'source', only separated by
+// whitespace: either a block comment ("/** */" or "/* */") or consecutive
+// lines starting with "#". Comment markers and common indentation are
+// stripped.
+std::optional<std::string> docCommentBefore(std::string_view source,
+                                            size_t offset);
+
+// A source file mapped into memory, with the offsets of its lines.
+class SourceFile {
+  public:
+    // Throws if the file cannot be opened.
+    explicit SourceFile(const std::string &path);
+
+    std::string_view text() const { return file.data(); }
+
+    // Offset of a 1-based line and column, if it is inside the file.
+    std::optional<size_t> offsetOf(uint32_t line, uint32_t column) const;
+
+  private:
+    MappedFile file;
+    // Offset of the first character of every line.
+    std::vector<size_t> lineStarts;
+};
+
+// Doc comments of source positions. Every file is mapped and indexed once.
+// Not thread-safe, meant to be used by the output writer only.
+class DocComments {
+  public:
+    std::optional<std::string> before(const std::optional<nix::Pos> &pos);
+
+  private:
+    // nullptr for files that could not be opened.
+    std::unordered_map<std::string, std::unique_ptr<SourceFile>> files;
+};
+
+}; // namespace flutsch
+
+#endif // DOC_COMMENTS_H
@@ -0,0 +1,75 @@
+#include <nix/error.hh>
+#include <nix/position.hh>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#ifndef ERRORS_H
+#define ERRORS_H
+
+namespace flutsch {
+
+struct ErrorKind {
+    // e.g. "Throw" or "TypeError"
+    std::string name;
+    // Which part of the message is written to the output.
+    enum { NoMessage, Hint, FullMessage } message = NoMessage;
+};
+
+// The ErrorInfo of 'error'. BaseError::info() first renders the complete
+// message with all traces (calcWhat), this does not. Only the parts that
+// are read get formatted.
+const nix::ErrorInfo &rawErrorInfo(const nix::BaseError &error);
+
+// Classify 'error' by its dynamic type. The result is cached per type, so
+// the classification only runs once per error class.
+const ErrorKind &classifyError(const nix::Error &error);
+
+// The message of 'error' that is written to the output, if 'kind' has one.
+std::optional<std::string> errorMessage(const nix::Error &error,
+                                        const ErrorKind &kind);
+
+// The trace of 'error', one frame per line.
+std::string formatTrace(const nix::Error &error);
+
+// Distinct errors, by position, kind and message.
+class ErrorTable {
+  public:
+    // Id of the matching error. New errors get the next free id, and their
+    // trace is formatted if 'withTrace' is set.
+    uint64_t add(const nix::Error &error, const ErrorKind &kind,
+                 const std::optional<std::string> &message, bool withTrace);
+
+    size_t size() const { return entries.size(); }
+
+    void write(const std::string &file) const;
+
+  private:
+    struct Entry {
+        std::string kind;
+        std::optional<std::string> message;
+        std::optional<nix::Pos> pos;
+        std::optional<std::string> trace;
+    };
+    // file, line, column, kind, message
+    typedef std::tuple<std::string, uint32_t, uint32_t, std::string,
+                       std::optional<std::string>>
+        Key;
+
+    std::map<Key, uint64_t> ids;
+    std::vector<Entry> entries;
+};
+
+// The evaluation hit the guard page of an isolated stack. The EvalState is
+// inconsistent from then on and must not be used for anything else.
+MakeError(StackOverflowError, nix::Error);
+
+// The error table stored next to the output file 'output'.
+std::string errorFileFor(const std::string &output);
+
+}; // namespace flutsch
+
+#endif // ERRORS_H
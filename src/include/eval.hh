@@ -1,6 +1,7 @@
 #include "nixexpr.hh"
 #include "position.hh"
 #include <iostream>
+#include <map>
 #include <optional>
 #include <unordered_map>
 #include <vector>
@@ -19,6 +20,9 @@ struct AttrEntry {
     std::optional<Pos> bindPos;
 
     bool isRoot = false;
+    // Stable id within a single run, assigned once the entry is tracked.
+    // Unlike 'value', it stays valid after the value has been released.
+    uint64_t id = 0;
     // Comparison logic needed for use in std::set.
     bool operator<(const AttrEntry &other) const;
     bool operator==(const AttrEntry &other) const;
@@ -107,6 +111,19 @@ struct ValueIntrospection {
 
     bool isError = false;
     std::optional<std::string> errorDescription;
+    // Id in the error table, replaces 'errorDescription' in the output.
+    std::optional<uint64_t> errorId;
+
+    // Number of elements of a list, or of attributes of a sampled attrset.
+    std::optional<size_t> count;
+    // Only some of the elements were introspected.
+    bool sampled = false;
+    // Number of elements per value type. Elements that were never
+    // evaluated are counted as "thunk".
+    std::optional<std::map<std::string, size_t>> elementTypes;
+    // Id of the attrset shape in the shape table, replaces 'children' in the
+    // output.
+    std::optional<uint64_t> shape;
     
     std::optional<std::unordered_map<uint,LambdaIntrospection>> lambdaIntrospections;
     // ValueIntrospection(ValueIntrospection &&o) : path(std::move(o.path)),
@@ -116,6 +133,12 @@ struct ValueIntrospection {
                                     const ValueIntrospection &obj);
 };
 
+// A finished value, ready to be written to the output.
+struct OutputRecord {
+    AttrEntry binding;
+    ValueIntrospection value;
+};
+
 }; // namespace flutsch
 
 
@@ -0,0 +1,97 @@
+/* Stable C interface of libflutsch.
+ *
+ * Results are exposed as one contiguous, versioned buffer that can be read
+ * in place: a header, a table of fixed size nodes and a string table.
+ * Everything in it is native endian and 4 byte aligned, and stays valid
+ * until the analyzer is run again or freed.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FLUTSCH_C_H
+#define FLUTSCH_C_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FLUTSCH_BUFFER_MAGIC "FLUTSCH"
+#define FLUTSCH_BUFFER_VERSION 2
+/* Missing parent, file or string. */
+#define FLUTSCH_NONE UINT32_MAX
+
+typedef enum {
+    FLUTSCH_NODE_ATTRSET = 0,
+    FLUTSCH_NODE_LAMBDA = 1,
+    FLUTSCH_NODE_DERIVATION = 2,
+    FLUTSCH_NODE_ERROR = 3,
+    FLUTSCH_NODE_VALUE = 4,
+    /* A value already reported under another path, e.g. through a cycle.
+     * Its children are not repeated. */
+    FLUTSCH_NODE_REPEAT = 5,
+} flutsch_node_kind;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_count;
+    /* Byte offsets from the start of the buffer. */
+    uint32_t nodes_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+    uint32_t reserved;
+} flutsch_buffer_header;
+
+typedef struct {
+    /* String offset, FLUTSCH_NONE if there is no position. */
+    uint32_t file;
+    uint32_t line;
+    uint32_t column;
+} flutsch_pos;
+
+/* Nodes are in depth first order, every parent before its children. */
+typedef struct {
+    /* Node index, FLUTSCH_NONE for the root. */
+    uint32_t parent;
+    /* String offsets. */
+    uint32_t name;
+    uint32_t type;
+    /* Error message, FLUTSCH_NONE unless kind is FLUTSCH_NODE_ERROR. */
+    uint32_t message;
+    /* One of flutsch_node_kind. */
+    uint32_t kind;
+    flutsch_pos binding_pos;
+    flutsch_pos value_pos;
+} flutsch_node;
+
+typedef struct flutsch_analyzer flutsch_analyzer;
+
+/* An analyzer for a Nix file, or a flake reference if 'is_flake' is set.
+ * Nothing is evaluated before flutsch_analyzer_run. NULL if 'expr' is NULL
+ * or the analyzer cannot be created. */
+flutsch_analyzer *flutsch_analyzer_new(const char *expr, int is_flake);
+
+void flutsch_analyzer_free(flutsch_analyzer *analyzer);
+
+/* Traverse the expression and fill the result buffer. Returns 0 on
+ * success, otherwise see flutsch_analyzer_error. */
+int flutsch_analyzer_run(flutsch_analyzer *analyzer);
+
+/* Message of the last failed run, NULL if it succeeded. */
+const char *flutsch_analyzer_error(const flutsch_analyzer *analyzer);
+
+/* The result buffer of the last successful run, NULL before that. */
+const void *flutsch_analyzer_buffer(const flutsch_analyzer *analyzer,
+                                    size_t *size);
+
+/* Helpers to read a buffer, equivalent to following the header offsets. */
+uint32_t flutsch_node_count(const void *buffer);
+const flutsch_node *flutsch_node_at(const void *buffer, uint32_t index);
+/* NULL for FLUTSCH_NONE. */
+const char *flutsch_string(const void *buffer, uint32_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FLUTSCH_C_H */
@@ -17,6 +17,9 @@ using namespace nix;
 
 namespace flutsch {
 
+// A traversal stops descending once it has introspected this many entries.
+const uint64_t maxEntries = 500;
+
 struct Config {
     const std::optional<std::vector<std::string>> useRecurseIntoAttrs;
     std::string releaseExpr;
@@ -30,18 +33,126 @@ struct Config {
     bool checkCacheStatus = false;
     size_t nrWorkers = 1;
     size_t maxMemorySize = 4096;
-
     // usually in MixFlakeOptions
     flake::LockFlags lockFlags = {.updateLockFile = false,
                                   .writeLockFile = false,
                                   .useRegistries = false,
                                   .allowUnlocked = false};
+
+    // Everything below is not initialized positionally.
+    // Walk a flake through the evaluation cache of Nix instead of
+    // evaluating everything.
+    bool evalCache = false;
+    // With evalCache, attrsets deeper than this are not descended into.
+    // Values are not forced to find cycles like pkgs.pkgs, this and
+    // maxEntries bound them instead.
+    size_t evalCacheDepth = 8;
+    // Stack size in MiB for the isolated evaluation of each top-level
+    // subtree. 0 evaluates everything on the main stack. Deep recursion is
+    // meant to end at Nix' max-call-depth, the guard at the end of the
+    // stack only catches what gets past it and ends the run.
+    size_t stackSize = 64;
+    // Only introspect the attributes at depth 'shardDepth' that hash to
+    // shard 'shardIndex' out of 'shardCount'. Everything above is part of
+    // every shard.
+    size_t shardIndex = 0;
+    size_t shardCount = 1;
+    size_t shardDepth = 1;
+    // Below every system but the canonical one, only introspect definitions
+    // whose binding position or type differs from the canonical system.
+    bool dedupeSystems = false;
+    // Defaults to the current system.
+    std::optional<std::string> canonicalSystem;
+    // Introspect the elements of lists, too.
+    bool traverseLists = false;
+    // Only introspect a sample of the elements of lists and attrsets with
+    // more than this many elements. 0 disables sampling.
+    size_t sampleThreshold = 0;
+    // Number of elements introspected per sampled collection.
+    size_t sampleSize = 32;
+    // Read curried lambdas from the syntax tree and only call functions if
+    // that is inconclusive.
+    bool staticLambdas = false;
+
+    // Directory to periodically write checkpoints to.
+    std::optional<std::string> checkpointDir;
+    // Minimum number of seconds between two checkpoints.
+    size_t checkpointInterval = 300;
+    // Directory of a checkpoint to resume from.
+    std::optional<std::string> resumeDir;
+
+    // File the introspection results are written to.
+    std::string outFile = "values.json";
+    // Write the output without indentation.
+    bool compact = false;
+    // Add the comment in front of every binding, lambda and formal.
+    bool docComments = false;
+    // Write the records ordered by attribute path, as needed by
+    // 'flutsch diff'. Holds all records until the end of the run.
+    bool sorted = false;
+    // Write a trigram index over attribute names and formals next to the
+    // output, for 'flutsch search'.
+    bool searchIndex = false;
+    // Write an index from source positions to attribute paths next to the
+    // output, for 'flutsch lookup'.
+    bool positionIndex = false;
+    // Write counters, phase times and memory use of the run next to the
+    // output.
+    bool stats = false;
+    // Report the progress on stderr while the traversal runs.
+    bool progress = false;
+    // Write each distinct error once to an error table and refer to it from
+    // the records.
+    bool errorTable = false;
+    // Write each distinct attrset shape once to a shape table and refer to
+    // it from the records instead of listing their children.
+    bool shapes = false;
+    // Drop finished entries and their Value pointers as soon as they are
+    // written. A 16 byte identity per visited value is still kept, so
+    // memory still grows with the number of visited values, only slower.
+    bool lowMemory = false;
+    // "json" (one array) or "ndjson" (one record per line)
+    std::string format = "json";
+    // Compress the output with zstd.
+    bool zstd = false;
+    int zstdLevel = 3;
+    // Compression worker threads. -1 uses the cores that are not busy.
+    int zstdThreads = -1;
+    // Record the files each top-level attribute depends on, next to the
+    // output.
+    bool trackDependencies = false;
+    // Output of a previous run. Only attributes whose dependencies changed
+    // are introspected again.
+    std::optional<std::string> previousOutput;
+    // Files changed since the previous run. Detected from the recorded
+    // fingerprints if empty.
+    std::vector<std::string> changedFiles;
+    // Keep running and update the output whenever a dependency changes.
+    bool watch = false;
+    // Read jobs as JSON lines from stdin and run them all in this process.
+    bool batch = false;
 };
 
 void getPositions(MixEvalArgs &args, flutsch::Config const &config);
 
 void recurseValues(std::vector<AttrEntry> attrPath, nix::Value *testAttrs);
 
+// Indices of the elements to introspect, out of a collection with 'size'
+// elements. Above the sample threshold, these are the first and last few
+// elements and a stride over the middle.
+std::vector<size_t> sampleIndices(size_t size, flutsch::Config const &config);
+
+// Name of the type of 'v' as written to the output. Does not force 'v'.
+std::string valueTypeName(Value &v);
+
+// Name of a list element in paths and children.
+std::string elementName(size_t index);
+
+bool startsWithDoubleUnderscore(const std::string &str);
+
+// An attrset whose drvPath has string context. 'value' must be forced.
+bool isDerivation(EvalState &state, Value &value);
+
 typedef std::unordered_map<AttrEntry, ValueIntrospection, AttrEntryHash>
     FlutschMap;
 
@@ -69,6 +180,11 @@ class Analyzer {
     std::string print_root_value();
 
     void bfs_traverse();
+
+    // Traverse the root value and report every node to 'visitor', without
+    // building records. False if it stopped at maxEntries. Defined in
+    // visitor.hh.
+    template <typename Visitor> bool visit(Visitor &visitor);
 };
 
 }; // namespace flutsch
@@ -0,0 +1,52 @@
+#include <cstddef>
+#include <functional>
+
+#ifndef ISOLATE_H
+#define ISOLATE_H
+
+namespace flutsch {
+
+enum class IsolationResult {
+    Completed,
+    // The function ran into the guard page of its stack.
+    StackOverflow,
+};
+
+// Allow other threads to register with the garbage collector. Must be
+// called from the main thread before the first runOnLargeStack or GcThread,
+// later calls do nothing.
+void allowGcThreads();
+
+// Run 'fn' on a dedicated thread with a stack of 'stackSize' bytes, at
+// least PTHREAD_STACK_MIN.
+//
+// The stack is protected by a guard region. A SIGSEGV inside that region is
+// caught, the thread is abandoned and StackOverflow is returned, instead of
+// killing the whole process. Frames skipped that way are not unwound: locks
+// they held stay locked, thunks they were forcing stay blackholed and the
+// allocator may be halfway through an update. After a StackOverflow, nothing
+// 'fn' touched (e.g. an EvalState) may be used again. This is a last resort,
+// Nix' max-call-depth should turn deep recursion into an ordinary error
+// long before the guard is reached.
+//
+// Exceptions thrown by 'fn' are rethrown on the calling thread.
+// The calling thread blocks until 'fn' is done, so 'fn' can safely use the
+// callers EvalState.
+IsolationResult runOnLargeStack(size_t stackSize,
+                                const std::function<void()> &fn);
+
+// Registers the calling thread with the garbage collector for the lifetime
+// of the object. Every thread other than the main thread that touches
+// Nix values needs one.
+class GcThread {
+  public:
+    GcThread();
+    ~GcThread();
+
+    GcThread(const GcThread &) = delete;
+    GcThread &operator=(const GcThread &) = delete;
+};
+
+}; // namespace flutsch
+
+#endif // ISOLATE_H
@@ -0,0 +1,116 @@
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+namespace flutsch {
+
+// Destination of serialized output.
+class OutputSink {
+  public:
+    virtual ~OutputSink() = default;
+    virtual void write(const char *data, size_t len) = 0;
+    // Flush everything that is still buffered and close the destination.
+    virtual void finish() {}
+};
+
+// Writes to a file, replacing it.
+class FileSink : public OutputSink {
+  public:
+    explicit FileSink(const std::string &path);
+    ~FileSink() override;
+
+    void write(const char *data, size_t len) override;
+    void finish() override;
+
+  private:
+    std::string path;
+    int fd = -1;
+};
+
+// Collects everything in memory, e.g. for a single record.
+class StringSink : public OutputSink {
+  public:
+    void write(const char *data, size_t len) override {
+        this->data.append(data, len);
+    }
+
+    std::string data;
+};
+
+// A streaming JSON writer.
+//
+// Values are serialized straight into a large buffer that is handed to the
+// sink in big chunks. No document is built in memory.
+// The formatting matches nlohmann::json::dump(indent), keys are written in
+// the order they are given.
+class JsonWriter {
+  public:
+    // 'indent' is the number of spaces per level, 0 writes compact output.
+    explicit JsonWriter(OutputSink &sink, int indent = 4,
+                        size_t bufferSize = 1 << 20);
+    ~JsonWriter();
+
+    JsonWriter(const JsonWriter &) = delete;
+    JsonWriter &operator=(const JsonWriter &) = delete;
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+
+    void key(std::string_view name);
+
+    void string(std::string_view s);
+    void number(uint64_t n);
+    void number(int64_t n);
+    void number(double n);
+    void boolean(bool b);
+    void null();
+
+    // A string, or null if there is none.
+    void optionalString(const std::optional<std::string> &s) {
+        if (s) {
+            string(*s);
+        } else {
+            null();
+        }
+    }
+
+    // End a top-level value with a newline, e.g. for NDJSON.
+    void lineBreak() { append("\n"); }
+
+    // Hand everything buffered to the sink.
+    void flush();
+
+  private:
+    struct Level {
+        bool isObject;
+        bool empty;
+    };
+
+    OutputSink &sink;
+    int indent;
+    size_t bufferSize;
+    std::string buf;
+    std::vector<Level> levels;
+    bool afterKey = false;
+
+    void beforeValue();
+    void newline(size_t depth);
+    void escaped(std::string_view s);
+    void append(std::string_view s) {
+        buf.append(s);
+        if (buf.size() >= bufferSize) {
+            flush();
+        }
+    }
+};
+
+}; // namespace flutsch
+
+#endif // JSON_WRITER_H
@@ -0,0 +1,29 @@
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+namespace flutsch {
+
+// A whole file mapped read-only into memory.
+class MappedFile {
+  public:
+    // Throws if the file cannot be opened or mapped.
+    explicit MappedFile(const std::string &path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    std::string_view data() const { return {start, size}; }
+
+  private:
+    const char *start = nullptr;
+    size_t size = 0;
+};
+
+}; // namespace flutsch
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,82 @@
+#include <nix/error.hh>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "mapped-file.hh"
+
+#ifndef MAPPED_INDEX_H
+#define MAPPED_INDEX_H
+
+namespace flutsch {
+
+// Indices written next to an output share this layout: a header that
+// starts with an IndexHeader, tables of fixed size rows, and a string table
+// of NUL-terminated strings. All integers are native endian.
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+};
+
+// Builds an index in memory and writes it at once.
+class IndexWriter {
+  public:
+    // Offset of 's' in the string table. Every string is stored once.
+    uint32_t intern(const std::string &s);
+
+    uint32_t stringsSize() const { return strings.size(); }
+
+    // Append the header or a table row.
+    template <typename T> void append(const T &value) {
+        data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    // Append the string table and atomically replace 'indexFile' with the
+    // index. 'kind' names the index in errors, e.g. "search index".
+    void write(const std::string &indexFile, const std::string &kind);
+
+  private:
+    std::string data;
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> offsets;
+};
+
+// A header with 'magic' and 'version', everything else zeroed.
+template <typename Header>
+Header indexHeader(const char (&magic)[8], uint32_t version) {
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.index.magic, magic, sizeof(magic));
+    header.index.version = version;
+    return header;
+}
+
+// Map 'indexFile' and check that it starts with a header of 'headerSize'
+// bytes with 'magic' and 'version'.
+std::unique_ptr<MappedFile> mapIndex(const std::string &indexFile,
+                                     const std::string &kind,
+                                     const char (&magic)[8], uint32_t version,
+                                     size_t headerSize);
+
+// Like mapIndex, and check that the file has the size 'expectedSize'
+// computes from its header.
+template <typename Header, typename ExpectedSize>
+std::unique_ptr<MappedFile>
+openIndex(const std::string &indexFile, const std::string &kind,
+          const char (&magic)[8], uint32_t version,
+          ExpectedSize expectedSize) {
+    auto file = mapIndex(indexFile, kind, magic, version, sizeof(Header));
+    Header header;
+    std::memcpy(&header, file->data().data(), sizeof(header));
+    if (file->data().size() != expectedSize(header)) {
+        throw nix::Error("%s '%s' is truncated", kind, indexFile);
+    }
+    return file;
+}
+
+}; // namespace flutsch
+
+#endif // MAPPED_INDEX_H
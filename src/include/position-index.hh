@@ -0,0 +1,53 @@
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mapped-file.hh"
+
+#ifndef POSITION_INDEX_H
+#define POSITION_INDEX_H
+
+namespace flutsch {
+
+struct PositionHit {
+    // "binding", "lambda" or "formal"
+    std::string kind;
+    // Attribute path of the record, joined with dots.
+    std::string path;
+    // The attribute or formal name.
+    std::string name;
+    uint32_t line;
+    uint32_t column;
+};
+
+// Index the binding, lambda and formal positions of the records in 'output'
+// by file and write it to 'indexFile'.
+void writePositionIndex(const std::string &output,
+                        const std::string &indexFile);
+
+// The position index stored next to the output file 'output'.
+std::string positionIndexFileFor(const std::string &output);
+
+// A position index, memory-mapped for lookups.
+//
+// Nix only records where a definition starts. A definition is assumed to
+// extend up to the next recorded position in the same file.
+class PositionIndex {
+  public:
+    // Throws if the file is not a position index of this version.
+    explicit PositionIndex(const std::string &indexFile);
+
+    // Everything defined at 'line' of 'file' (at or after 'column', if it
+    // is not 0). If nothing starts there, the definitions at the closest
+    // position before it. Logarithmic in the number of positions.
+    std::vector<PositionHit> at(const std::string &file, uint32_t line,
+                                uint32_t column = 0) const;
+
+  private:
+    std::unique_ptr<MappedFile> file;
+};
+
+}; // namespace flutsch
+
+#endif // POSITION_INDEX_H
@@ -0,0 +1,102 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+namespace flutsch {
+
+// Counters shared between the traversal and the progress reporter. Updates
+// are relaxed atomic increments, so the traversal never waits for the
+// reporter. Workers share one instance.
+class Progress {
+  public:
+    // 'n' attributes or list elements were found and will be taken later.
+    void discover(size_t n) {
+        frontier.fetch_add(int64_t(n), std::memory_order_relaxed);
+    }
+    // A discovered attribute is about to be visited or skipped.
+    void take() { frontier.fetch_sub(1, std::memory_order_relaxed); }
+    void visit() { visited.fetch_add(1, std::memory_order_relaxed); }
+    void fail() { errors.fetch_add(1, std::memory_order_relaxed); }
+
+    // Whether the reporter is waiting for the current attribute path.
+    // Cheap enough to ask for every node, so that the path is only joined
+    // once per refresh.
+    bool wantsPath() const {
+        return pathWanted.load(std::memory_order_relaxed);
+    }
+    void setPath(std::string current);
+
+    struct Snapshot {
+        uint64_t visited;
+        // Discovered but not visited yet. Each of them may have children
+        // that are not discovered yet.
+        uint64_t frontier;
+        uint64_t errors;
+        std::string path;
+    };
+    // Also asks the traversal for a new path.
+    Snapshot snapshot();
+
+  private:
+    std::atomic<uint64_t> visited{0};
+    std::atomic<int64_t> frontier{0};
+    std::atomic<uint64_t> errors{0};
+
+    std::atomic<bool> pathWanted{true};
+    std::mutex pathLock;
+    std::string path;
+};
+
+// Reports 'progress' on stderr from a separate thread until it is
+// destroyed. On a terminal a single status line is refreshed several times
+// a second, otherwise a JSON line is written every few seconds.
+//
+// While the status line is shown, std::cout is silenced if it goes to a
+// terminal as well, so that per-node messages do not break up the line.
+class ProgressReporter {
+  public:
+    explicit ProgressReporter(Progress &progress);
+    ~ProgressReporter();
+
+    ProgressReporter(const ProgressReporter &) = delete;
+    ProgressReporter &operator=(const ProgressReporter &) = delete;
+
+    // The run succeeded. Without it, the last report says the run failed.
+    void finish();
+
+  private:
+    void run();
+    void report(bool done);
+
+    Progress &progress;
+    bool tty;
+    // The buffer of std::cout while it is silenced.
+    std::streambuf *silenced = nullptr;
+    std::chrono::steady_clock::time_point start;
+    // Nodes per second, smoothed over the last refreshes.
+    double rate = 0;
+    uint64_t lastVisited = 0;
+    std::chrono::steady_clock::time_point lastReport;
+    // Last time a node was visited. A single value can take long to
+    // evaluate, this tells how long.
+    std::chrono::steady_clock::time_point lastChange;
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    bool stopped = false;
+    bool finished = false;
+    std::thread thread;
+};
+
+}; // namespace flutsch
+
+#endif // PROGRESS_H
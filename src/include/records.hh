@@ -0,0 +1,54 @@
+#include <nix/position.hh>
+#include <nlohmann/json.hpp>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "compression.hh"
+#include "flutsch.hh"
+#include "json-writer.hh"
+
+#ifndef RECORDS_H
+#define RECORDS_H
+
+namespace flutsch {
+
+// Read all records of a flutsch output file as a json array. Accepts JSON
+// and NDJSON output, optionally zstd compressed. Holds the whole output in
+// memory, prefer RecordReader for large files.
+nlohmann::json readRecords(const std::string &path);
+
+// Reads the records of a flutsch output file one at a time, so that only
+// the current record is held in memory. Accepts the same files as
+// readRecords.
+class RecordReader {
+  public:
+    explicit RecordReader(const std::string &path);
+
+    // The next record, std::nullopt after the last one.
+    std::optional<nlohmann::json> next();
+
+  private:
+    std::string path;
+    std::unique_ptr<InputSource> input;
+    std::string buf;
+    size_t pos = 0;
+    bool started = false;
+
+    // The next character without consuming it, -1 at the end of the input.
+    int peek();
+};
+
+// A source position as written to the records, null if there is none.
+nlohmann::json posToJson(std::optional<nix::Pos> pos);
+
+// Write an already parsed document, e.g. a record of a previous run.
+void writeJsonValue(JsonWriter &out, const nlohmann::json &j);
+
+// Open the output file, compressed if requested.
+std::unique_ptr<OutputSink> openOutput(const std::string &path,
+                                       flutsch::Config const &config);
+
+}; // namespace flutsch
+
+#endif // RECORDS_H
@@ -0,0 +1,16 @@
+#include <string>
+
+#include "flutsch.hh"
+
+#ifndef RESULT_BUFFER_H
+#define RESULT_BUFFER_H
+
+namespace flutsch {
+
+// Traverse the root of 'analyzer' into a buffer with the layout of
+// flutsch-c.h. init_root_value must have been called.
+std::string buildResultBuffer(Analyzer &analyzer);
+
+}; // namespace flutsch
+
+#endif // RESULT_BUFFER_H
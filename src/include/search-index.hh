@@ -0,0 +1,46 @@
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mapped-file.hh"
+
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+namespace flutsch {
+
+struct SearchHit {
+    // The attribute name or formal that matched.
+    std::string name;
+    // Attribute path of the match, joined with dots.
+    std::string path;
+    // 'name' is a formal of the function at 'path'.
+    bool formal = false;
+};
+
+// Build a trigram index over the attribute names and formals of the records
+// in 'output' and write it to 'indexFile'.
+void writeSearchIndex(const std::string &output, const std::string &indexFile);
+
+// The search index stored next to the output file 'output'.
+std::string searchIndexFileFor(const std::string &output);
+
+// A search index, memory-mapped for lookups.
+class SearchIndex {
+  public:
+    // Throws if the file is not a search index of this version.
+    explicit SearchIndex(const std::string &indexFile);
+
+    // Names containing 'query', ignoring ASCII case. Exact matches come
+    // first, then prefix matches, then the rest; shorter paths first.
+    std::vector<SearchHit> find(std::string_view query, size_t limit) const;
+
+  private:
+    std::unique_ptr<MappedFile> file;
+};
+
+}; // namespace flutsch
+
+#endif // SEARCH_INDEX_H
@@ -0,0 +1,49 @@
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef SHAPES_H
+#define SHAPES_H
+
+namespace flutsch {
+
+// The structure of a value: its type and, for attrsets, the names of its
+// attributes together with the shapes of their values.
+struct Shape {
+    // e.g. "attrset", "int" or "lambda"
+    std::string type;
+    // Sorted by name. Refers to the ids of already interned shapes.
+    std::vector<std::pair<std::string, uint64_t>> fields;
+
+    bool operator==(const Shape &other) const = default;
+};
+
+struct ShapeHash {
+    size_t operator()(const Shape &shape) const noexcept;
+};
+
+// Hash-consed shapes: structurally equal shapes share a single id.
+class ShapeTable {
+  public:
+    // The id of 'shape'. New shapes get the next free id.
+    uint64_t intern(Shape shape);
+
+    size_t size() const { return shapes.size(); }
+
+    // Write all shapes, ordered by id.
+    void write(const std::string &file) const;
+
+  private:
+    std::unordered_map<Shape, uint64_t, ShapeHash> ids;
+    // Points into 'ids', indexed by id.
+    std::vector<const Shape *> shapes;
+};
+
+// The shape table stored next to the output file 'output'.
+std::string shapeFileFor(const std::string &output);
+
+}; // namespace flutsch
+
+#endif // SHAPES_H
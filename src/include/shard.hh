@@ -0,0 +1,31 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "flutsch.hh"
+
+#ifndef SHARD_H
+#define SHARD_H
+
+namespace flutsch {
+
+// 64 bit FNV-1a of an attribute path. Unlike std::hash, it is the same on
+// every machine.
+uint64_t stableHash(const std::vector<std::string> &path);
+
+// Whether the attribute at 'path' (without "<root>") belongs to the shard
+// of this run. The same path lands on the same shard on every machine.
+bool inShard(const std::vector<std::string> &path,
+             flutsch::Config const &config);
+
+// Combine the outputs of several shards into config.outFile. Records that
+// appear in more than one shard, e.g. the common ancestors of all shards,
+// are matched by binding position and attribute path and written once.
+// Records are streamed, only the keys of the written records are held in
+// memory.
+void mergeOutputs(const std::vector<std::string> &inputs,
+                  flutsch::Config const &config);
+
+}; // namespace flutsch
+
+#endif // SHARD_H
@@ -0,0 +1,86 @@
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+namespace flutsch {
+
+// A bounded, lock-free queue for exactly one producer and one consumer.
+//
+// Both sides only block (via atomic wait) when the queue is full or empty
+// respectively. The producer may change threads as long as two threads never
+// push at the same time.
+template <typename T> class SpscQueue {
+  public:
+    // 'capacity' is rounded up to a power of two.
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // Producer only. Blocks while the queue is full.
+    void push(T item) { put(std::move(item)); }
+
+    // Producer only. Nothing may be pushed afterwards. The consumer receives
+    // std::nullopt once it has taken everything pushed before.
+    void close() { put(std::nullopt); }
+
+    // Consumer only. Blocks until an item is available.
+    std::optional<T> pop() {
+        if (drained) {
+            return std::nullopt;
+        }
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        while (t == h) {
+            tail.wait(t, std::memory_order_acquire);
+            t = tail.load(std::memory_order_acquire);
+        }
+        std::optional<T> item = std::move(slots[h & mask]);
+        slots[h & mask].reset();
+        head.store(h + 1, std::memory_order_release);
+        head.notify_one();
+        if (!item) {
+            drained = true;
+        }
+        return item;
+    }
+
+  private:
+    // An empty slot marks the end of the queue.
+    std::vector<std::optional<T>> slots;
+    size_t mask;
+
+    // Next slot to read. Written by the consumer only.
+    alignas(64) std::atomic<size_t> head{0};
+    // Next slot to write. Written by the producer only.
+    alignas(64) std::atomic<size_t> tail{0};
+    // The consumer has seen the end of the queue.
+    bool drained = false;
+
+    void put(std::optional<T> item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        while (t - h > mask) {
+            head.wait(h, std::memory_order_acquire);
+            h = head.load(std::memory_order_acquire);
+        }
+        slots[t & mask] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+    }
+};
+
+}; // namespace flutsch
+
+#endif // SPSC_QUEUE_H
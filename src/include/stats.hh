@@ -0,0 +1,81 @@
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include <nlohmann/json.hpp>
+
+#ifndef STATS_H
+#define STATS_H
+
+namespace flutsch {
+
+// Counters and timings of a single run, written with --stats.
+struct RunStats {
+    // Every attribute and list element reached, including the root.
+    uint64_t nodesVisited = 0;
+    // Values forced for introspection.
+    uint64_t valuesForced = 0;
+    // Visits of values that were already introspected (or written and
+    // released) through another path.
+    uint64_t dedupeHits = 0;
+    uint64_t lambdasUnwrapped = 0;
+    uint64_t functorsUnwrapped = 0;
+    // Number of functors by the number of lambdas unwrapped from them.
+    std::map<size_t, uint64_t> functorDepths;
+    // Number of lambdas by the number of curried lambdas unwrapped.
+    std::map<size_t, uint64_t> lambdaDepths;
+    // By error kind, e.g. "Throw"
+    std::map<std::string, uint64_t> errors;
+    uint64_t derivationsSkipped = 0;
+    // Definitions skipped with --dedupe-systems.
+    uint64_t systemCopiesSkipped = 0;
+
+    // Wall clock time by phase: "root_eval", "traversal", "serialization"
+    // and "write". Serialization runs on the writer thread while the
+    // traversal goes on, so the phases overlap.
+    std::map<std::string, std::chrono::nanoseconds> phases;
+
+    void addUnwrap(size_t depth, bool functor);
+
+    // Add the counters of 'other'. Phases of passes that ran concurrently
+    // are not summed up, the longer one counts.
+    void merge(const RunStats &other);
+
+    // Includes the peak RSS and the GC heap of the process at the time of
+    // the call.
+    nlohmann::json toJson() const;
+};
+
+// Adds the time until it is destroyed to a phase.
+class PhaseTimer {
+  public:
+    PhaseTimer(RunStats &stats, std::string phase)
+        : stats(stats), phase(std::move(phase)),
+          start(std::chrono::steady_clock::now()) {}
+    ~PhaseTimer() {
+        stats.phases[phase] += std::chrono::steady_clock::now() - start;
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+  private:
+    RunStats &stats;
+    std::string phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Current size of the garbage collected heap, if Nix uses Boehm GC.
+std::optional<uint64_t> gcHeapSize();
+
+void writeStats(const RunStats &stats, const std::string &file);
+
+// The statistics stored next to the output file 'output'.
+std::string statsFileFor(const std::string &output);
+
+}; // namespace flutsch
+
+#endif // STATS_H
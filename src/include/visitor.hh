@@ -0,0 +1,164 @@
+#ifndef VISITOR_H
+#define VISITOR_H
+
+#include <nix/eval-inline.hh>
+#include <nix/eval.hh>
+#include <nix/nixexpr.hh>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+#include "flutsch.hh"
+
+namespace flutsch {
+
+// Views handed to visitors. They point into the running traversal and are
+// only valid during the callback, copy whatever should outlive it.
+struct NodeView {
+    // Attribute path below the root, without "<root>".
+    const std::vector<std::string> &path;
+    nix::Value &value;
+    // Resolve with state.positions, if needed.
+    nix::PosIdx bindPos;
+    nix::EvalState &state;
+};
+
+struct AttrsetView : NodeView {};
+
+struct LambdaView : NodeView {
+    nix::ExprLambda &fun;
+};
+
+// Derivations are reported, but not traversed.
+struct DerivationView : NodeView {};
+
+// Forcing the value failed. 'value' is unusable.
+struct ErrorView : NodeView {
+    const nix::Error &error;
+};
+
+// Any other value: numbers, strings, paths, lists that are not traversed.
+struct ValueView : NodeView {};
+
+// A value that was already visited under another path, e.g. through a
+// cycle. It is not forced or traversed again.
+struct RepeatView : NodeView {};
+
+// Depth first traversal that reports every node to 'Visitor'.
+//
+// A visitor implements any of
+//   on_attrset(const AttrsetView &)
+//   on_lambda(const LambdaView &)
+//   on_derivation(const DerivationView &)
+//   on_error(const ErrorView &)
+//   on_value(const ValueView &)
+//   on_repeat(const RepeatView &)
+// Hooks it does not implement are compiled out. If on_attrset returns bool,
+// false skips the children of that attrset.
+//
+// Attributes starting with "__" are reported but not traversed. Sampling
+// and list traversal follow the Config. Like the introspection, the
+// traversal stops after maxEntries nodes, run() tells whether it did.
+template <typename Visitor> class Traversal {
+  public:
+    Traversal(nix::EvalState &state, Config const &config, Visitor &visitor)
+        : state(state), config(config), visitor(visitor) {}
+
+    // False if the traversal stopped at maxEntries.
+    bool run(nix::Value &root) {
+        path.clear();
+        visited.clear();
+        entries = 0;
+        limitReached = false;
+        visit(root, nix::noPos, true);
+        return !limitReached;
+    }
+
+  private:
+    nix::EvalState &state;
+    Config const &config;
+    Visitor &visitor;
+    std::vector<std::string> path;
+    std::unordered_set<const nix::Value *> visited;
+    uint64_t entries = 0;
+    bool limitReached = false;
+
+    void visit(nix::Value &value, nix::PosIdx bindPos, bool recurse) {
+        if (entries == maxEntries) {
+            limitReached = true;
+            return;
+        }
+        entries++;
+        NodeView node{path, value, bindPos, state};
+        if (!visited.insert(&value).second) {
+            if constexpr (requires { visitor.on_repeat(RepeatView{node}); }) {
+                visitor.on_repeat(RepeatView{node});
+            }
+            return;
+        }
+        try {
+            state.forceValue(value, nix::noPos);
+            if (value.type() == nix::nAttrs) {
+                if (isDerivation(state, value)) {
+                    if constexpr (requires { visitor.on_derivation(
+                                      DerivationView{node}); }) {
+                        visitor.on_derivation(DerivationView{node});
+                    }
+                    return;
+                }
+                visitAttrs(node, recurse);
+            } else if (value.isLambda()) {
+                if constexpr (requires { visitor.on_lambda(
+                                  LambdaView{node, *value.lambda.fun}); }) {
+                    visitor.on_lambda(LambdaView{node, *value.lambda.fun});
+                }
+            } else if (value.type() == nix::nList && config.traverseLists &&
+                       recurse) {
+                auto elems = value.listElems();
+                for (size_t index : sampleIndices(value.listSize(), config)) {
+                    path.push_back(elementName(index));
+                    visit(*elems[index], nix::noPos, true);
+                    path.pop_back();
+                }
+            } else if constexpr (requires { visitor.on_value(
+                                     ValueView{node}); }) {
+                visitor.on_value(ValueView{node});
+            }
+        } catch (nix::Error &e) {
+            if constexpr (requires { visitor.on_error(ErrorView{node, e}); }) {
+                visitor.on_error(ErrorView{node, e});
+            }
+        }
+    }
+
+    void visitAttrs(const NodeView &node, bool recurse) {
+        if constexpr (requires { visitor.on_attrset(AttrsetView{node}); }) {
+            using Result = decltype(visitor.on_attrset(AttrsetView{node}));
+            if constexpr (std::is_same_v<Result, bool>) {
+                recurse = visitor.on_attrset(AttrsetView{node}) && recurse;
+            } else {
+                visitor.on_attrset(AttrsetView{node});
+            }
+        }
+        if (!recurse) {
+            return;
+        }
+        auto sorted = node.value.attrs->lexicographicOrder(state.symbols);
+        for (size_t index : sampleIndices(sorted.size(), config)) {
+            auto &attr = sorted[index];
+            const std::string &name = state.symbols[attr->name];
+            path.push_back(name);
+            visit(*attr->value, attr->pos, !startsWithDoubleUnderscore(name));
+            path.pop_back();
+        }
+    }
+};
+
+template <typename Visitor> bool Analyzer::visit(Visitor &visitor) {
+    return Traversal<Visitor>(*state, config, visitor).run(vRoot);
+}
+
+}; // namespace flutsch
+
+#endif // VISITOR_H
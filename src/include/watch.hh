@@ -0,0 +1,38 @@
+#include <map>
+#include <set>
+#include <string>
+
+#ifndef WATCH_H
+#define WATCH_H
+
+namespace flutsch {
+
+// Waits for changes of a set of files.
+//
+// The parent directories are watched instead of the files themselves, so
+// that editors which save by renaming a temporary file are noticed as well.
+class FileWatcher {
+  public:
+    FileWatcher();
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    // Replace the set of watched files.
+    void watch(const std::set<std::string> &files);
+
+    // Block until at least one watched file changed. Changes arriving
+    // shortly after the first one are returned together.
+    std::set<std::string> waitForChanges();
+
+  private:
+    int fd = -1;
+    // watch descriptor -> directory
+    std::map<int, std::string> dirs;
+    std::set<std::string> files;
+};
+
+}; // namespace flutsch
+
+#endif // WATCH_H
@@ -0,0 +1,64 @@
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+namespace flutsch {
+
+// Jobs spread over one deque per worker.
+//
+// A worker takes jobs from the front of its own deque. Once that is empty,
+// it steals from the back of the others, so that a worker stuck on a huge
+// subtree does not hold back the jobs dealt to it.
+template <typename T> class WorkStealingQueue {
+  public:
+    explicit WorkStealingQueue(size_t workers) : deques(workers) {}
+
+    WorkStealingQueue(const WorkStealingQueue &) = delete;
+    WorkStealingQueue &operator=(const WorkStealingQueue &) = delete;
+
+    // Deal a job to the next worker, round robin. Only before any worker
+    // started popping.
+    void push(T job) {
+        deques[dealt++ % deques.size()].jobs.push_back(std::move(job));
+    }
+
+    // The next job for 'worker', std::nullopt once all deques are empty.
+    std::optional<T> pop(size_t worker) {
+        {
+            auto &own = deques[worker];
+            std::lock_guard lock(own.mutex);
+            if (!own.jobs.empty()) {
+                T job = std::move(own.jobs.front());
+                own.jobs.pop_front();
+                return job;
+            }
+        }
+        for (size_t n = 1; n < deques.size(); n++) {
+            auto &victim = deques[(worker + n) % deques.size()];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.jobs.empty()) {
+                T job = std::move(victim.jobs.back());
+                victim.jobs.pop_back();
+                return job;
+            }
+        }
+        return std::nullopt;
+    }
+
+  private:
+    struct Deque {
+        std::mutex mutex;
+        std::deque<T> jobs;
+    };
+    std::vector<Deque> deques;
+    size_t dealt = 0;
+};
+
+}; // namespace flutsch
+
+#endif // WORK_QUEUE_H
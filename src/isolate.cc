@@ -0,0 +1,199 @@
+#include <nix/config.h>
+
+#include <algorithm>
+#include <climits>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if HAVE_BOEHMGC
+#define GC_THREADS
+#include <gc/gc.h>
+#endif
+
+#include "isolate.hh"
+
+namespace flutsch {
+
+namespace {
+
+// Everything below the usable stack that is mapped PROT_NONE.
+// Deliberately generous: a single huge frame may jump over a small guard.
+constexpr size_t guardSize = 1024 * 1024;
+constexpr size_t altStackSize = 64 * 1024;
+
+struct IsolatedJob {
+    const std::function<void()> *fn;
+
+    char *guardLo = nullptr;
+    char *guardHi = nullptr;
+    sigjmp_buf jump;
+    volatile sig_atomic_t armed = 0;
+
+    bool overflowed = false;
+    std::exception_ptr error;
+};
+
+thread_local IsolatedJob *currentJob = nullptr;
+
+struct sigaction previousAction;
+std::once_flag installHandlerOnce;
+std::once_flag allowThreadsOnce;
+
+void onSegv(int sig, siginfo_t *info, void *ctx) {
+    IsolatedJob *job = currentJob;
+    char *addr = static_cast<char *>(info->si_addr);
+
+    if (job != nullptr && job->armed && addr >= job->guardLo &&
+        addr < job->guardHi) {
+        job->armed = 0;
+        siglongjmp(job->jump, 1);
+    }
+
+    // Not a fault we are responsible for. Hand it to whoever was installed
+    // before us (e.g. the stack overflow detection of libnixmain).
+    if (previousAction.sa_flags & SA_SIGINFO) {
+        if (previousAction.sa_sigaction != nullptr) {
+            previousAction.sa_sigaction(sig, info, ctx);
+            return;
+        }
+    } else if (previousAction.sa_handler != SIG_DFL &&
+               previousAction.sa_handler != SIG_IGN) {
+        previousAction.sa_handler(sig);
+        return;
+    }
+    // Returning re-executes the faulting instruction with the default
+    // action, which terminates the process as it would have without us.
+    signal(SIGSEGV, SIG_DFL);
+}
+
+void installHandler() {
+    struct sigaction act;
+    std::memset(&act, 0, sizeof(act));
+    act.sa_sigaction = onSegv;
+    act.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&act.sa_mask);
+    if (sigaction(SIGSEGV, &act, &previousAction) != 0) {
+        throw std::runtime_error("failed to install SIGSEGV handler");
+    }
+}
+
+void *runJob(void *arg) {
+    auto *job = static_cast<IsolatedJob *>(arg);
+
+#if HAVE_BOEHMGC
+    // Values referenced only from this stack must stay visible to the GC.
+    struct GC_stack_base sb;
+    GC_get_stack_base(&sb);
+    GC_register_my_thread(&sb);
+#endif
+
+    // The handler cannot run on the stack that just overflowed.
+    std::string altStack(altStackSize, '\0');
+    stack_t ss;
+    ss.ss_sp = altStack.data();
+    ss.ss_size = altStack.size();
+    ss.ss_flags = 0;
+    sigaltstack(&ss, nullptr);
+
+    currentJob = job;
+    if (sigsetjmp(job->jump, 1) == 0) {
+        job->armed = 1;
+        try {
+            (*job->fn)();
+        } catch (...) {
+            job->error = std::current_exception();
+        }
+        job->armed = 0;
+    } else {
+        job->overflowed = true;
+    }
+    currentJob = nullptr;
+
+    ss.ss_flags = SS_DISABLE;
+    sigaltstack(&ss, nullptr);
+
+#if HAVE_BOEHMGC
+    GC_unregister_my_thread();
+#endif
+    return nullptr;
+}
+
+} // namespace
+
+void allowGcThreads() {
+#if HAVE_BOEHMGC
+    std::call_once(allowThreadsOnce, []() { GC_allow_register_threads(); });
+#endif
+}
+
+IsolationResult runOnLargeStack(size_t stackSize,
+                                const std::function<void()> &fn) {
+    std::call_once(installHandlerOnce, installHandler);
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    // pthread_attr_setstack rejects anything smaller.
+    stackSize = std::max(stackSize, size_t(PTHREAD_STACK_MIN));
+    stackSize = (stackSize + pageSize - 1) / pageSize * pageSize;
+
+    // Pages are only backed once touched, so a large reservation is cheap.
+    size_t mapSize = guardSize + stackSize;
+    void *mem = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("failed to allocate isolated stack");
+    }
+    char *base = static_cast<char *>(mem);
+    mprotect(base, guardSize, PROT_NONE);
+
+    IsolatedJob job;
+    job.fn = &fn;
+    job.guardLo = base;
+    job.guardHi = base + guardSize;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, base + guardSize, stackSize);
+
+    pthread_t thread;
+    int rc = pthread_create(&thread, &attr, runJob, &job);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        munmap(mem, mapSize);
+        throw std::runtime_error("failed to start isolated thread");
+    }
+    pthread_join(thread, nullptr);
+    munmap(mem, mapSize);
+
+    if (job.overflowed) {
+        return IsolationResult::StackOverflow;
+    }
+    if (job.error) {
+        std::rethrow_exception(job.error);
+    }
+    return IsolationResult::Completed;
+}
+
+GcThread::GcThread() {
+#if HAVE_BOEHMGC
+    struct GC_stack_base sb;
+    GC_get_stack_base(&sb);
+    GC_register_my_thread(&sb);
+#endif
+}
+
+GcThread::~GcThread() {
+#if HAVE_BOEHMGC
+    GC_unregister_my_thread();
+#endif
+}
+
+}; // namespace flutsch
@@ -0,0 +1,253 @@
+#include <nix/error.hh>
+
+#include <charconv>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <nlohmann/json.hpp>
+
+#include "json-writer.hh"
+
+namespace flutsch {
+
+FileSink::FileSink(const std::string &path) : path(path) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw nix::SysError("opening '%s'", path);
+    }
+}
+
+FileSink::~FileSink() {
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+void FileSink::write(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw nix::SysError("writing to '%s'", path);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+void FileSink::finish() {
+    if (fd != -1 && close(fd) == -1) {
+        fd = -1;
+        throw nix::SysError("closing '%s'", path);
+    }
+    fd = -1;
+}
+
+JsonWriter::JsonWriter(OutputSink &sink, int indent, size_t bufferSize)
+    : sink(sink), indent(indent), bufferSize(bufferSize) {
+    buf.reserve(bufferSize + 4096);
+}
+
+JsonWriter::~JsonWriter() {
+    try {
+        flush();
+    } catch (...) {
+        // Errors must be observed by calling flush() explicitly.
+    }
+}
+
+void JsonWriter::flush() {
+    if (!buf.empty()) {
+        sink.write(buf.data(), buf.size());
+        buf.clear();
+    }
+}
+
+void JsonWriter::newline(size_t depth) {
+    if (indent == 0) {
+        return;
+    }
+    buf.push_back('\n');
+    buf.append(depth * indent, ' ');
+}
+
+void JsonWriter::beforeValue() {
+    if (afterKey) {
+        afterKey = false;
+        return;
+    }
+    if (levels.empty()) {
+        return;
+    }
+    Level &level = levels.back();
+    if (!level.empty) {
+        buf.push_back(',');
+    }
+    level.empty = false;
+    newline(levels.size());
+}
+
+void JsonWriter::beginObject() {
+    beforeValue();
+    buf.push_back('{');
+    levels.push_back({true, true});
+}
+
+void JsonWriter::endObject() {
+    bool empty = levels.back().empty;
+    levels.pop_back();
+    if (!empty) {
+        newline(levels.size());
+    }
+    append("}");
+}
+
+void JsonWriter::beginArray() {
+    beforeValue();
+    buf.push_back('[');
+    levels.push_back({false, true});
+}
+
+void JsonWriter::endArray() {
+    bool empty = levels.back().empty;
+    levels.pop_back();
+    if (!empty) {
+        newline(levels.size());
+    }
+    append("]");
+}
+
+void JsonWriter::key(std::string_view name) {
+    beforeValue();
+    escaped(name);
+    append(indent == 0 ? ":" : ": ");
+    afterKey = true;
+}
+
+void JsonWriter::string(std::string_view s) {
+    beforeValue();
+    escaped(s);
+}
+
+void JsonWriter::number(uint64_t n) {
+    beforeValue();
+    char tmp[24];
+    auto res = std::to_chars(tmp, tmp + sizeof(tmp), n);
+    append(std::string_view(tmp, res.ptr - tmp));
+}
+
+void JsonWriter::number(int64_t n) {
+    beforeValue();
+    char tmp[24];
+    auto res = std::to_chars(tmp, tmp + sizeof(tmp), n);
+    append(std::string_view(tmp, res.ptr - tmp));
+}
+
+void JsonWriter::number(double n) {
+    beforeValue();
+    // Floats are rare, and nlohmann's formatting differs from to_chars
+    // (e.g. "1.0" instead of "1", null for NaN).
+    append(nlohmann::json(n).dump());
+}
+
+void JsonWriter::boolean(bool b) {
+    beforeValue();
+    append(b ? "true" : "false");
+}
+
+void JsonWriter::null() {
+    beforeValue();
+    append("null");
+}
+
+static inline bool needsEscape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+static void escapeChar(std::string &buf, unsigned char c) {
+    switch (c) {
+    case '"':
+        buf.append("\\\"");
+        break;
+    case '\\':
+        buf.append("\\\\");
+        break;
+    case '\b':
+        buf.append("\\b");
+        break;
+    case '\f':
+        buf.append("\\f");
+        break;
+    case '\n':
+        buf.append("\\n");
+        break;
+    case '\r':
+        buf.append("\\r");
+        break;
+    case '\t':
+        buf.append("\\t");
+        break;
+    default: {
+        char tmp[7];
+        snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+        buf.append(tmp, 6);
+    }
+    }
+}
+
+void JsonWriter::escaped(std::string_view s) {
+    buf.push_back('"');
+
+    const char *p = s.data();
+    const char *end = p + s.size();
+
+#if defined(__SSE2__)
+    // Look at 16 bytes at once. Most strings (names, paths) contain nothing
+    // that needs escaping and are copied in one go.
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        // unsigned c <= 0x1f  <=>  max(c, 0x1f) == 0x1f
+        __m128i isControl =
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control);
+        __m128i special =
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                      _mm_cmpeq_epi8(chunk, backslash)),
+                         isControl);
+        int mask = _mm_movemask_epi8(special);
+        if (mask == 0) {
+            buf.append(p, 16);
+            p += 16;
+            continue;
+        }
+        int first = __builtin_ctz(mask);
+        buf.append(p, first);
+        escapeChar(buf, static_cast<unsigned char>(p[first]));
+        p += first + 1;
+    }
+#endif
+
+    const char *run = p;
+    for (; p < end; p++) {
+        if (needsEscape(static_cast<unsigned char>(*p))) {
+            buf.append(run, p - run);
+            escapeChar(buf, static_cast<unsigned char>(*p));
+            run = p + 1;
+        }
+    }
+    buf.append(run, p - run);
+
+    append("\"");
+}
+
+}; // namespace flutsch
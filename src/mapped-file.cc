@@ -0,0 +1,43 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped-file.hh"
+
+namespace flutsch {
+
+MappedFile::MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open '" + path +
+                                 "': " + std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("cannot stat '" + path + "'");
+    }
+    size = st.st_size;
+    if (size > 0) {
+        void *mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("cannot map '" + path + "'");
+        }
+        start = static_cast<const char *>(mem);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (start != nullptr) {
+        munmap(const_cast<char *>(start), size);
+    }
+}
+
+}; // namespace flutsch
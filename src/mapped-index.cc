@@ -0,0 +1,52 @@
+#include <filesystem>
+#include <fstream>
+
+#include "mapped-index.hh"
+
+namespace flutsch {
+
+uint32_t IndexWriter::intern(const std::string &s) {
+    auto [it, inserted] = offsets.emplace(s, strings.size());
+    if (inserted) {
+        strings.append(s);
+        strings.push_back('\0');
+    }
+    return it->second;
+}
+
+void IndexWriter::write(const std::string &indexFile,
+                        const std::string &kind) {
+    data.append(strings);
+    std::string tmp = indexFile + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        if (!out.is_open()) {
+            throw nix::Error("cannot open %s '%s'", kind, tmp);
+        }
+        out.write(data.data(), data.size());
+    }
+    std::filesystem::rename(tmp, indexFile);
+}
+
+std::unique_ptr<MappedFile> mapIndex(const std::string &indexFile,
+                                     const std::string &kind,
+                                     const char (&magic)[8], uint32_t version,
+                                     size_t headerSize) {
+    auto file = std::make_unique<MappedFile>(indexFile);
+    auto data = file->data();
+    IndexHeader header;
+    if (data.size() < headerSize) {
+        throw nix::Error("'%s' is not a %s", indexFile, kind);
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.magic, magic, sizeof(magic)) != 0) {
+        throw nix::Error("'%s' is not a %s", indexFile, kind);
+    }
+    if (header.version != version) {
+        throw nix::Error("%s '%s' has version %d, expected %d", kind,
+                         indexFile, header.version, version);
+    }
+    return file;
+}
+
+}; // namespace flutsch
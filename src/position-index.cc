@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <tuple>
+
+#include <nlohmann/json.hpp>
+
+#include "mapped-index.hh"
+#include "position-index.hh"
+#include "records.hh"
+
+using namespace nlohmann;
+
+namespace flutsch {
+
+// File layout, see mapped-index.hh, all integers uint32:
+//   header
+//   files      fileCount x {name, first entry, entry count}, sorted by name
+//   entries    entryCount x {line, column, kind, path, name}, sorted by
+//              file, line and column
+//   strings    NUL-terminated
+namespace {
+
+constexpr char indexMagic[8] = "FLTPOSI";
+constexpr uint32_t indexVersion = 1;
+
+const char *const kinds[] = {"binding", "lambda", "formal"};
+
+struct Header {
+    IndexHeader index;
+    uint32_t fileCount;
+    uint32_t entryCount;
+    uint32_t stringsSize;
+};
+
+struct File {
+    uint32_t name;
+    uint32_t first;
+    uint32_t count;
+};
+
+struct Entry {
+    uint32_t line;
+    uint32_t column;
+    uint32_t kind;
+    uint32_t path;
+    uint32_t name;
+};
+
+struct Sections {
+    const Header *header;
+    const File *files;
+    const Entry *entries;
+    const char *strings;
+};
+
+Sections sectionsOf(std::string_view data) {
+    Sections s;
+    s.header = reinterpret_cast<const Header *>(data.data());
+    s.files = reinterpret_cast<const File *>(s.header + 1);
+    s.entries = reinterpret_cast<const Entry *>(s.files + s.header->fileCount);
+    s.strings = reinterpret_cast<const char *>(s.entries + s.header->entryCount);
+    return s;
+}
+
+} // namespace
+
+void writePositionIndex(const std::string &output,
+                        const std::string &indexFile) {
+    IndexWriter writer;
+    // Entries by file name. Sets, because shared values appear in several
+    // records.
+    std::map<std::string,
+             std::set<std::tuple<uint32_t, uint32_t, uint32_t, std::string,
+                                 std::string>>>
+        byFile;
+    const auto add = [&](const json &pos, uint32_t kind,
+                         const std::string &path, const std::string &name) {
+        if (!pos.is_object() || !pos.at("file").is_string()) {
+            return;
+        }
+        byFile[pos.at("file").get<std::string>()].emplace(
+            pos.at("line").get<uint32_t>(), pos.at("column").get<uint32_t>(),
+            kind, path, name);
+    };
+
+    RecordReader reader(output);
+    while (auto record = reader.next()) {
+        auto &value = record->at("value");
+        auto segments = value.at("path").get<std::vector<std::string>>();
+        // The first segment is "<root>".
+        if (segments.size() < 2) {
+            continue;
+        }
+        std::string path;
+        for (size_t n = 1; n < segments.size(); n++) {
+            path += (n > 1 ? "." : "") + segments[n];
+        }
+        add(record->at("binding").at("pos"), 0, path, segments.back());
+
+        auto lambdas = value.find("lambda");
+        if (lambdas == value.end() || !lambdas->is_object()) {
+            continue;
+        }
+        for (auto &[_, lambda] : lambdas->items()) {
+            add(lambda.at("pos"), 1, path, segments.back());
+            for (auto &formal : lambda.at("formals")) {
+                add(formal.at("pos"), 2, path,
+                    formal.at("name").get<std::string>());
+            }
+        }
+    }
+
+    std::vector<File> files;
+    std::vector<Entry> entries;
+    for (auto &[name, fileEntries] : byFile) {
+        files.push_back({writer.intern(name), uint32_t(entries.size()),
+                         uint32_t(fileEntries.size())});
+        for (auto &[line, column, kind, path, entryName] : fileEntries) {
+            entries.push_back({line, column, kind, writer.intern(path),
+                               writer.intern(entryName)});
+        }
+    }
+
+    auto header = indexHeader<Header>(indexMagic, indexVersion);
+    header.fileCount = files.size();
+    header.entryCount = entries.size();
+    header.stringsSize = writer.stringsSize();
+    writer.append(header);
+    for (auto &file : files) {
+        writer.append(file);
+    }
+    for (auto &entry : entries) {
+        writer.append(entry);
+    }
+    writer.write(indexFile, "position index");
+}
+
+std::string positionIndexFileFor(const std::string &output) {
+    std::filesystem::path path(output);
+    return path.replace_extension(".positions.idx").string();
+}
+
+PositionIndex::PositionIndex(const std::string &indexFile)
+    : file(openIndex<Header>(
+          indexFile, "position index", indexMagic, indexVersion,
+          [](const Header &header) {
+              return sizeof(Header) + header.fileCount * sizeof(File) +
+                     header.entryCount * sizeof(Entry) + header.stringsSize;
+          })) {}
+
+std::vector<PositionHit> PositionIndex::at(const std::string &name,
+                                           uint32_t line,
+                                           uint32_t column) const {
+    auto s = sectionsOf(file->data());
+    const File *filesEnd = s.files + s.header->fileCount;
+    auto f = std::lower_bound(s.files, filesEnd, name,
+                              [&](const File &file, const std::string &name) {
+                                  return s.strings + file.name < name;
+                              });
+    if (f == filesEnd || s.strings + f->name != name) {
+        return {};
+    }
+
+    const Entry *begin = s.entries + f->first;
+    const Entry *end = begin + f->count;
+    const auto before = [](const Entry &e, std::pair<uint32_t, uint32_t> p) {
+        return std::make_pair(e.line, e.column) < p;
+    };
+    auto first = std::lower_bound(begin, end, std::make_pair(line, column),
+                                  before);
+    auto last = std::lower_bound(begin, end, std::make_pair(line + 1, 0u),
+                                 before);
+    if (first == last && first != begin) {
+        // Nothing starts on this line. The closest definition before it.
+        auto &closest = *(first - 1);
+        last = first;
+        first = std::lower_bound(
+            begin, end, std::make_pair(closest.line, closest.column), before);
+    }
+
+    std::vector<PositionHit> hits;
+    for (auto e = first; e != last; e++) {
+        hits.push_back({kinds[e->kind], s.strings + e->path,
+                        s.strings + e->name, e->line, e->column});
+    }
+    return hits;
+}
+
+}; // namespace flutsch
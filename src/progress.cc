@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <utility>
+
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+#include "progress.hh"
+#include "stats.hh"
+
+using namespace nlohmann;
+
+namespace flutsch {
+
+namespace {
+
+// Refresh interval of the status line on a terminal.
+constexpr std::chrono::milliseconds terminalInterval{200};
+// Interval of the JSON lines otherwise.
+constexpr std::chrono::milliseconds lineInterval{5000};
+// Weight of the latest interval in the smoothed rate.
+constexpr double rateWeight = 0.3;
+// Time without a visited node after which the status line says so.
+constexpr double idleThreshold = 5;
+
+std::string formatBytes(uint64_t bytes) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double size = bytes;
+    size_t unit = 0;
+    while (size >= 1024 && unit < 4) {
+        size /= 1024;
+        unit++;
+    }
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << size << " " << units[unit];
+    return out.str();
+}
+
+// e.g. "42s", "3m05s" or "1h02m"
+std::string formatSeconds(double seconds) {
+    auto s = uint64_t(seconds + 0.5);
+    std::ostringstream out;
+    out << std::setfill('0');
+    if (s >= 3600) {
+        out << s / 3600 << "h" << std::setw(2) << s % 3600 / 60 << "m";
+    } else if (s >= 60) {
+        out << s / 60 << "m" << std::setw(2) << s % 60 << "s";
+    } else {
+        out << s << "s";
+    }
+    return out.str();
+}
+
+size_t terminalWidth() {
+    struct winsize size;
+    if (ioctl(STDERR_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+        return size.ws_col;
+    }
+    return 80;
+}
+
+} // namespace
+
+void Progress::setPath(std::string current) {
+    std::lock_guard guard(pathLock);
+    path = std::move(current);
+    pathWanted.store(false, std::memory_order_relaxed);
+}
+
+Progress::Snapshot Progress::snapshot() {
+    Snapshot result;
+    result.visited = visited.load(std::memory_order_relaxed);
+    result.frontier = uint64_t(
+        std::max<int64_t>(0, frontier.load(std::memory_order_relaxed)));
+    result.errors = errors.load(std::memory_order_relaxed);
+    {
+        std::lock_guard guard(pathLock);
+        result.path = path;
+    }
+    pathWanted.store(true, std::memory_order_relaxed);
+    return result;
+}
+
+ProgressReporter::ProgressReporter(Progress &progress)
+    : progress(progress), tty(isatty(STDERR_FILENO)),
+      start(std::chrono::steady_clock::now()), lastReport(start),
+      lastChange(start) {
+    // Before the traversal starts writing to std::cout.
+    if (tty && isatty(STDOUT_FILENO)) {
+        silenced = std::cout.rdbuf(nullptr);
+    }
+    thread = std::thread([this]() { run(); });
+}
+
+ProgressReporter::~ProgressReporter() {
+    {
+        std::lock_guard guard(lock);
+        stopped = true;
+    }
+    wakeup.notify_one();
+    thread.join();
+    if (silenced != nullptr) {
+        std::cout.rdbuf(silenced);
+    }
+}
+
+void ProgressReporter::finish() {
+    std::lock_guard guard(lock);
+    finished = true;
+}
+
+void ProgressReporter::run() {
+    auto interval = tty ? terminalInterval : lineInterval;
+    std::unique_lock guard(lock);
+    while (!wakeup.wait_for(guard, interval, [&]() { return stopped; })) {
+        report(false);
+    }
+    report(true);
+}
+
+void ProgressReporter::report(bool done) {
+    auto now = std::chrono::steady_clock::now();
+    auto current = progress.snapshot();
+
+    double window = std::chrono::duration<double>(now - lastReport).count();
+    double elapsed = std::chrono::duration<double>(now - start).count();
+    if (window > 0) {
+        double latest = double(current.visited - lastVisited) / window;
+        rate = lastReport == start
+                   ? latest
+                   : rateWeight * latest + (1 - rateWeight) * rate;
+    }
+    if (current.visited != lastVisited) {
+        lastChange = now;
+    }
+    lastVisited = current.visited;
+    lastReport = now;
+    double idle = std::chrono::duration<double>(now - lastChange).count();
+    // 'lock' is held by run().
+    bool failed = done && !finished;
+    if (done && elapsed > 0) {
+        rate = current.visited / elapsed;
+    }
+
+    // Every node of the frontier may still have children, so this is a
+    // lower bound that gets better as the frontier shrinks.
+    std::optional<double> eta;
+    if (current.frontier == 0) {
+        eta = 0;
+    } else if (rate > 0) {
+        eta = current.frontier / rate;
+    }
+    auto heapSize = gcHeapSize();
+
+    if (!tty) {
+        json line = {{"elapsed", elapsed},
+                     {"visited", current.visited},
+                     {"rate", rate},
+                     {"frontier", current.frontier},
+                     {"errors", current.errors},
+                     {"heap_size", heapSize ? json(*heapSize) : json()},
+                     {"eta", eta ? json(*eta) : json()},
+                     {"idle", idle},
+                     {"path", current.path},
+                     {"done", done && !failed},
+                     {"failed", failed}};
+        std::cerr << line.dump() << std::endl;
+        return;
+    }
+
+    std::ostringstream status;
+    status << current.visited << " nodes, " << uint64_t(rate) << "/s, "
+           << "frontier " << current.frontier << ", " << current.errors
+           << " errors";
+    if (heapSize) {
+        status << ", heap " << formatBytes(*heapSize);
+    }
+    if (failed) {
+        status << ", failed after " << formatSeconds(elapsed);
+    } else if (done) {
+        status << ", done in " << formatSeconds(elapsed);
+    } else {
+        if (eta) {
+            status << ", ETA " << formatSeconds(*eta);
+        }
+        if (idle >= idleThreshold) {
+            status << ", no progress for " << formatSeconds(idle);
+        }
+        if (!current.path.empty()) {
+            status << ": " << current.path;
+        }
+    }
+
+    // Longer lines would wrap, and "\r" only returns to the last line.
+    std::string text = status.str();
+    size_t width = terminalWidth();
+    if (text.size() >= width) {
+        text.resize(width - 1);
+    }
+    std::cerr << "\r\033[K" << text;
+    if (done) {
+        std::cerr << std::endl;
+    } else {
+        std::cerr << std::flush;
+    }
+}
+
+}; // namespace flutsch
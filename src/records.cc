@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <thread>
+
+#include "compression.hh"
+#include "records.hh"
+
+using namespace nix;
+using namespace nlohmann;
+
+namespace flutsch {
+
+json readRecords(const std::string &path) {
+    json records = json::array();
+    RecordReader reader(path);
+    while (auto record = reader.next()) {
+        records.push_back(std::move(*record));
+    }
+    return records;
+}
+
+RecordReader::RecordReader(const std::string &path)
+    : path(path), input(openInput(path)) {}
+
+int RecordReader::peek() {
+    if (pos == buf.size()) {
+        buf.resize(1 << 20);
+        buf.resize(input->read(buf.data(), buf.size()));
+        pos = 0;
+        if (buf.empty()) {
+            return -1;
+        }
+    }
+    return static_cast<unsigned char>(buf[pos]);
+}
+
+std::optional<json> RecordReader::next() {
+    // Whitespace, the array brackets and the commas between records.
+    while (true) {
+        int c = peek();
+        if (c == -1 || (c == ']' && started)) {
+            return std::nullopt;
+        }
+        if (c == '{') {
+            break;
+        }
+        if (c == '[' && !started) {
+            started = true;
+        } else if (c != ',' && c != ' ' && c != '\t' && c != '\r' &&
+                   c != '\n') {
+            throw Error("unexpected '%c' in '%s'", char(c), path);
+        }
+        pos++;
+    }
+    started = true;
+
+    // Everything up to the matching closing brace.
+    std::string record;
+    size_t depth = 0;
+    bool inString = false;
+    bool escaped = false;
+    while (true) {
+        int c = peek();
+        if (c == -1) {
+            throw Error("'%s' is truncated", path);
+        }
+        record.push_back(char(c));
+        pos++;
+        if (inString) {
+            if (escaped) {
+                escaped = false;
+            } else if (c == '\\') {
+                escaped = true;
+            } else if (c == '"') {
+                inString = false;
+            }
+        } else if (c == '"') {
+            inString = true;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if ((c == '}' || c == ']') && --depth == 0) {
+            return json::parse(record);
+        }
+    }
+}
+
+json posToJson(std::optional<Pos> pos) {
+    if (!pos.has_value()) {
+        json j_null;
+        return j_null;
+    }
+    auto source = std::optional<std::string>({});
+    if (auto path = std::get_if<SourcePath>(&pos.value().origin)) {
+        source = path->path.c_str();
+    }
+    return json::object({{"column", pos.value().column},
+                         {"line", pos.value().line},
+                         {"file", source}});
+}
+
+void writeJsonValue(JsonWriter &out, const json &j) {
+    switch (j.type()) {
+    case json::value_t::object:
+        out.beginObject();
+        for (auto &[key, value] : j.items()) {
+            out.key(key);
+            writeJsonValue(out, value);
+        }
+        out.endObject();
+        break;
+    case json::value_t::array:
+        out.beginArray();
+        for (auto &value : j) {
+            writeJsonValue(out, value);
+        }
+        out.endArray();
+        break;
+    case json::value_t::string:
+        out.string(j.get_ref<const std::string &>());
+        break;
+    case json::value_t::boolean:
+        out.boolean(j.get<bool>());
+        break;
+    case json::value_t::number_unsigned:
+        out.number(j.get<uint64_t>());
+        break;
+    case json::value_t::number_integer:
+        out.number(j.get<int64_t>());
+        break;
+    case json::value_t::number_float:
+        out.number(j.get<double>());
+        break;
+    default:
+        out.null();
+        break;
+    }
+}
+
+std::unique_ptr<OutputSink> openOutput(const std::string &path,
+                                       flutsch::Config const &config) {
+    std::unique_ptr<OutputSink> sink = std::make_unique<FileSink>(path);
+    if (config.zstd) {
+        int threads = config.zstdThreads;
+        if (threads < 0) {
+            // Evaluation and the writer thread keep two cores busy.
+            int cores = std::thread::hardware_concurrency();
+            threads = std::clamp(cores - 2, 0, 8);
+        }
+        sink = std::make_unique<ZstdSink>(std::move(sink), config.zstdLevel,
+                                          threads);
+    }
+    return sink;
+}
+
+}; // namespace flutsch
@@ -0,0 +1,127 @@
+#include <nix/eval.hh>
+#include <nix/position.hh>
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "errors.hh"
+#include "flutsch-c.h"
+#include "result-buffer.hh"
+#include "visitor.hh"
+
+namespace flutsch {
+
+namespace {
+
+// Collects the nodes and strings of a traversal.
+struct BufferBuilder {
+    std::vector<flutsch_node> nodes;
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> offsets;
+    // Index of the innermost node at every depth of the current path.
+    std::vector<uint32_t> open;
+
+    uint32_t intern(const std::string &s) {
+        auto [it, inserted] = offsets.emplace(s, strings.size());
+        if (inserted) {
+            strings.append(s);
+            strings.push_back('\0');
+        }
+        return it->second;
+    }
+
+    flutsch_pos pos(nix::EvalState &state, nix::PosIdx idx) {
+        flutsch_pos result{FLUTSCH_NONE, 0, 0};
+        if (!idx) {
+            return result;
+        }
+        auto p = state.positions[idx];
+        if (auto path = std::get_if<nix::SourcePath>(&p.origin)) {
+            result.file = intern(path->path.abs());
+        }
+        result.line = p.line;
+        result.column = p.column;
+        return result;
+    }
+
+    flutsch_node &add(const NodeView &view, flutsch_node_kind kind) {
+        size_t depth = view.path.size();
+        open.resize(depth);
+        flutsch_node node;
+        node.parent = depth == 0 ? FLUTSCH_NONE : open[depth - 1];
+        node.name = intern(depth == 0 ? "<root>" : view.path.back());
+        node.type = FLUTSCH_NONE;
+        node.message = FLUTSCH_NONE;
+        node.kind = kind;
+        node.binding_pos = pos(view.state, view.bindPos);
+        node.value_pos = {FLUTSCH_NONE, 0, 0};
+        open.push_back(nodes.size());
+        return nodes.emplace_back(node);
+    }
+
+    void on_attrset(const AttrsetView &view) {
+        auto &node = add(view, FLUTSCH_NODE_ATTRSET);
+        node.type = intern("attrset");
+        node.value_pos = pos(view.state, view.value.attrs->pos);
+    }
+
+    void on_lambda(const LambdaView &view) {
+        auto &node = add(view, FLUTSCH_NODE_LAMBDA);
+        node.type = intern("lambda");
+        node.value_pos = pos(view.state, view.fun.getPos());
+    }
+
+    void on_derivation(const DerivationView &view) {
+        add(view, FLUTSCH_NODE_DERIVATION).type = intern("derivation");
+    }
+
+    void on_error(const ErrorView &view) {
+        auto &node = add(view, FLUTSCH_NODE_ERROR);
+        node.type = intern(classifyError(view.error).name);
+        node.message = intern(rawErrorInfo(view.error).msg.str());
+    }
+
+    void on_value(const ValueView &view) {
+        add(view, FLUTSCH_NODE_VALUE).type = intern(valueTypeName(view.value));
+    }
+
+    void on_repeat(const RepeatView &view) {
+        add(view, FLUTSCH_NODE_REPEAT);
+    }
+};
+
+} // namespace
+
+std::string buildResultBuffer(Analyzer &analyzer) {
+    BufferBuilder builder;
+    analyzer.visit(builder);
+
+    flutsch_buffer_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, FLUTSCH_BUFFER_MAGIC,
+                sizeof(FLUTSCH_BUFFER_MAGIC));
+    header.version = FLUTSCH_BUFFER_VERSION;
+    header.node_count = builder.nodes.size();
+    header.nodes_offset = sizeof(header);
+
+    size_t nodesSize = builder.nodes.size() * sizeof(flutsch_node);
+    size_t total = sizeof(header) + nodesSize + builder.strings.size();
+    if (total > UINT32_MAX) {
+        throw std::length_error("result buffer exceeds 4 GiB");
+    }
+    header.strings_offset = sizeof(header) + nodesSize;
+    header.strings_size = builder.strings.size();
+
+    std::string buffer;
+    buffer.reserve(total);
+    buffer.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    buffer.append(reinterpret_cast<const char *>(builder.nodes.data()),
+                  nodesSize);
+    buffer.append(builder.strings);
+    return buffer;
+}
+
+}; // namespace flutsch
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <tuple>
+
+#include <nlohmann/json.hpp>
+
+#include "mapped-index.hh"
+#include "records.hh"
+#include "search-index.hh"
+
+using namespace nlohmann;
+
+namespace flutsch {
+
+// File layout, see mapped-index.hh, all integers uint32:
+//   header
+//   entries    entryCount x {name, path, formal}, names and paths are
+//              string offsets
+//   trigrams   trigramCount x {trigram, first posting, posting count},
+//              sorted by trigram
+//   postings   entry ids, sorted per trigram
+//   strings    NUL-terminated
+namespace {
+
+constexpr char indexMagic[8] = "FLTSRCH";
+constexpr uint32_t indexVersion = 1;
+
+struct Header {
+    IndexHeader index;
+    uint32_t entryCount;
+    uint32_t trigramCount;
+    uint32_t postingCount;
+    uint32_t stringsSize;
+    uint32_t reserved;
+};
+
+struct Entry {
+    uint32_t name;
+    uint32_t path;
+    uint32_t formal;
+};
+
+struct Trigram {
+    uint32_t trigram;
+    uint32_t first;
+    uint32_t count;
+};
+
+std::string lowercase(std::string_view s) {
+    std::string result(s);
+    for (auto &c : result) {
+        if (c >= 'A' && c <= 'Z') {
+            c = c - 'A' + 'a';
+        }
+    }
+    return result;
+}
+
+// The distinct trigrams of an already lowercased string.
+std::set<uint32_t> trigramsOf(const std::string &s) {
+    std::set<uint32_t> result;
+    for (size_t n = 0; n + 3 <= s.size(); n++) {
+        result.insert(uint32_t(uint8_t(s[n])) << 16 |
+                      uint32_t(uint8_t(s[n + 1])) << 8 |
+                      uint32_t(uint8_t(s[n + 2])));
+    }
+    return result;
+}
+
+} // namespace
+
+void writeSearchIndex(const std::string &output,
+                      const std::string &indexFile) {
+    std::vector<Entry> entries;
+    IndexWriter writer;
+    std::map<uint32_t, std::vector<uint32_t>> postings;
+    const auto add = [&](const std::string &name, uint32_t path,
+                         bool formal) {
+        uint32_t id = entries.size();
+        entries.push_back({writer.intern(name), path, formal});
+        for (auto trigram : trigramsOf(lowercase(name))) {
+            postings[trigram].push_back(id);
+        }
+    };
+
+    RecordReader reader(output);
+    while (auto record = reader.next()) {
+        auto &value = record->at("value");
+        auto segments = value.at("path").get<std::vector<std::string>>();
+        // The first segment is "<root>".
+        if (segments.size() < 2) {
+            continue;
+        }
+        std::string joined;
+        for (size_t n = 1; n < segments.size(); n++) {
+            joined += (n > 1 ? "." : "") + segments[n];
+        }
+        uint32_t path = writer.intern(joined);
+        add(segments.back(), path, false);
+
+        std::set<std::string> formals;
+        auto lambdas = value.find("lambda");
+        if (lambdas != value.end() && lambdas->is_object()) {
+            for (auto &[_, lambda] : lambdas->items()) {
+                for (auto &formal : lambda.at("formals")) {
+                    formals.insert(formal.at("name").get<std::string>());
+                }
+            }
+        }
+        for (auto &formal : formals) {
+            add(formal, path, true);
+        }
+    }
+
+    auto header = indexHeader<Header>(indexMagic, indexVersion);
+    header.entryCount = entries.size();
+    header.trigramCount = postings.size();
+    for (auto &[_, ids] : postings) {
+        header.postingCount += ids.size();
+    }
+    header.stringsSize = writer.stringsSize();
+    writer.append(header);
+    for (auto &entry : entries) {
+        writer.append(entry);
+    }
+    uint32_t first = 0;
+    for (auto &[trigram, ids] : postings) {
+        writer.append(Trigram{trigram, first, uint32_t(ids.size())});
+        first += ids.size();
+    }
+    for (auto &[_, ids] : postings) {
+        for (auto id : ids) {
+            writer.append(id);
+        }
+    }
+    writer.write(indexFile, "search index");
+}
+
+std::string searchIndexFileFor(const std::string &output) {
+    std::filesystem::path path(output);
+    return path.replace_extension(".search.idx").string();
+}
+
+SearchIndex::SearchIndex(const std::string &indexFile)
+    : file(openIndex<Header>(
+          indexFile, "search index", indexMagic, indexVersion,
+          [](const Header &header) {
+              return sizeof(Header) + header.entryCount * sizeof(Entry) +
+                     header.trigramCount * sizeof(Trigram) +
+                     header.postingCount * sizeof(uint32_t) +
+                     header.stringsSize;
+          })) {}
+
+// Sections of the mapped file, see the layout above.
+struct Sections {
+    const Header *header;
+    const Entry *entries;
+    const Trigram *trigrams;
+    const uint32_t *postings;
+    const char *strings;
+};
+
+static Sections sectionsOf(std::string_view data) {
+    Sections s;
+    s.header = reinterpret_cast<const Header *>(data.data());
+    s.entries = reinterpret_cast<const Entry *>(s.header + 1);
+    s.trigrams =
+        reinterpret_cast<const Trigram *>(s.entries + s.header->entryCount);
+    s.postings =
+        reinterpret_cast<const uint32_t *>(s.trigrams + s.header->trigramCount);
+    s.strings =
+        reinterpret_cast<const char *>(s.postings + s.header->postingCount);
+    return s;
+}
+
+// Entries that contain every trigram of 'query'. Queries shorter than a
+// trigram match every entry.
+static std::vector<uint32_t> candidates(const Sections &s,
+                                        const std::string &query) {
+    auto trigrams = trigramsOf(query);
+    if (trigrams.empty()) {
+        std::vector<uint32_t> all(s.header->entryCount);
+        for (uint32_t id = 0; id < all.size(); id++) {
+            all[id] = id;
+        }
+        return all;
+    }
+
+    std::vector<const Trigram *> lists;
+    const Trigram *begin = s.trigrams;
+    const Trigram *end = begin + s.header->trigramCount;
+    for (auto trigram : trigrams) {
+        auto it = std::lower_bound(
+            begin, end, trigram,
+            [](const Trigram &t, uint32_t value) { return t.trigram < value; });
+        if (it == end || it->trigram != trigram) {
+            return {};
+        }
+        lists.push_back(it);
+    }
+    // Intersect, starting with the shortest list.
+    std::sort(lists.begin(), lists.end(),
+              [](auto a, auto b) { return a->count < b->count; });
+    const uint32_t *ids = s.postings + lists[0]->first;
+    std::vector<uint32_t> result(ids, ids + lists[0]->count);
+    for (size_t n = 1; n < lists.size() && !result.empty(); n++) {
+        ids = s.postings + lists[n]->first;
+        std::vector<uint32_t> both;
+        std::set_intersection(result.begin(), result.end(), ids,
+                              ids + lists[n]->count, std::back_inserter(both));
+        result = std::move(both);
+    }
+    return result;
+}
+
+std::vector<SearchHit> SearchIndex::find(std::string_view query,
+                                         size_t limit) const {
+    auto s = sectionsOf(file->data());
+    std::string needle = lowercase(query);
+    // Rank, path length and entry id of every match.
+    std::vector<std::tuple<int, size_t, uint32_t>> matches;
+    for (auto id : candidates(s, needle)) {
+        std::string name = lowercase(s.strings + s.entries[id].name);
+        size_t at = name.find(needle);
+        if (at == std::string::npos) {
+            continue;
+        }
+        int rank = name == needle ? 0 : at == 0 ? 1 : 2;
+        matches.emplace_back(rank, std::strlen(s.strings + s.entries[id].path),
+                             id);
+    }
+    std::sort(matches.begin(), matches.end());
+
+    std::vector<SearchHit> hits;
+    for (auto &[rank, length, id] : matches) {
+        if (hits.size() == limit) {
+            break;
+        }
+        auto &entry = s.entries[id];
+        hits.push_back({s.strings + entry.name, s.strings + entry.path,
+                        entry.formal != 0});
+    }
+    return hits;
+}
+
+}; // namespace flutsch
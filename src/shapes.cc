@@ -0,0 +1,61 @@
+#include <nix/error.hh>
+
+#include <filesystem>
+#include <fstream>
+
+#include <nlohmann/json.hpp>
+
+#include "shapes.hh"
+
+using namespace nlohmann;
+
+namespace flutsch {
+
+size_t ShapeHash::operator()(const Shape &shape) const noexcept {
+    std::hash<std::string> stringHash;
+    std::hash<uint64_t> idHash;
+    size_t result = stringHash(shape.type);
+    // Field shapes are interned already, so this never recurses.
+    for (auto &[name, id] : shape.fields) {
+        result ^= stringHash(name) + 0x9e3779b9 + (result << 6) + (result >> 2);
+        result ^= idHash(id) + 0x9e3779b9 + (result << 6) + (result >> 2);
+    }
+    return result;
+}
+
+uint64_t ShapeTable::intern(Shape shape) {
+    auto [it, inserted] = ids.emplace(std::move(shape), shapes.size());
+    if (inserted) {
+        shapes.push_back(&it->first);
+    }
+    return it->second;
+}
+
+void ShapeTable::write(const std::string &file) const {
+    json j = json::array();
+    for (size_t id = 0; id < shapes.size(); id++) {
+        json fields = json::object();
+        for (auto &[name, fieldId] : shapes[id]->fields) {
+            fields[name] = fieldId;
+        }
+        j.push_back(json::object(
+            {{"id", id}, {"type", shapes[id]->type}, {"fields", fields}}));
+    }
+
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream out(tmp);
+        if (!out.is_open()) {
+            throw nix::Error("cannot open shape file '%s'", tmp);
+        }
+        out << j.dump(2);
+    }
+    std::filesystem::rename(tmp, file);
+}
+
+std::string shapeFileFor(const std::string &output) {
+    std::filesystem::path path(output);
+    return path.replace_extension(".shapes.json").string();
+}
+
+}; // namespace flutsch
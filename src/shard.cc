@@ -0,0 +1,89 @@
+#include <nix/error.hh>
+
+#include <filesystem>
+#include <iostream>
+#include <unordered_set>
+
+#include <nlohmann/json.hpp>
+
+#include "json-writer.hh"
+#include "records.hh"
+#include "shard.hh"
+
+using namespace nlohmann;
+
+namespace flutsch {
+
+uint64_t stableHash(const std::vector<std::string> &path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (auto &segment : path) {
+        for (unsigned char c : segment) {
+            hash ^= c;
+            hash *= 0x100000001b3ULL;
+        }
+        // Separator, so that ["ab", "c"] and ["a", "bc"] differ.
+        hash ^= 0xff;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+bool inShard(const std::vector<std::string> &path,
+             flutsch::Config const &config) {
+    if (config.shardCount <= 1) {
+        return true;
+    }
+    return stableHash(path) % config.shardCount == config.shardIndex;
+}
+
+void mergeOutputs(const std::vector<std::string> &inputs,
+                  flutsch::Config const &config) {
+    std::string filename = config.outFile;
+    std::string tmpFilename = filename + ".tmp";
+    auto sink = openOutput(tmpFilename, config);
+    bool ndjson = config.format == "ndjson";
+    JsonWriter out(*sink, config.compact || ndjson ? 0 : 4);
+    if (!ndjson) {
+        out.beginArray();
+    }
+
+    std::unordered_set<std::string> seen;
+    size_t written = 0;
+    for (auto &input : inputs) {
+        size_t duplicates = 0;
+        RecordReader reader(input);
+        while (auto record = reader.next()) {
+            auto &value = record->at("value");
+            // Ids into tables that differ between the shards.
+            if (value.contains("shape") || value.contains("error_id")) {
+                throw nix::Error("cannot merge '%s': it was written with "
+                                 "--shapes or --error-table",
+                                 input);
+            }
+            std::string key = record->at("binding").at("pos").dump() + "\n" +
+                              value.at("path").dump();
+            if (!seen.insert(std::move(key)).second) {
+                duplicates++;
+                continue;
+            }
+            writeJsonValue(out, *record);
+            if (ndjson) {
+                out.lineBreak();
+            }
+            written++;
+        }
+        std::cout << "Merged " << input << " (" << duplicates
+                  << " duplicates)" << std::endl;
+    }
+
+    if (!ndjson) {
+        out.endArray();
+    }
+    out.flush();
+    sink->finish();
+    std::filesystem::rename(tmpFilename, filename);
+    std::cout << "Success: " << written << " records written to: " << filename
+              << std::endl;
+}
+
+}; // namespace flutsch
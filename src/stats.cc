@@ -0,0 +1,122 @@
+#include <nix/config.h>
+#include <nix/error.hh>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+#include <sys/resource.h>
+
+#if HAVE_BOEHMGC
+#define GC_THREADS
+#include <gc/gc.h>
+#endif
+
+#include "stats.hh"
+
+using namespace nix;
+using namespace nlohmann;
+
+namespace flutsch {
+
+void RunStats::addUnwrap(size_t depth, bool functor) {
+    if (functor) {
+        functorsUnwrapped++;
+        functorDepths[depth]++;
+    } else {
+        lambdasUnwrapped++;
+        lambdaDepths[depth]++;
+    }
+}
+
+void RunStats::merge(const RunStats &other) {
+    nodesVisited += other.nodesVisited;
+    valuesForced += other.valuesForced;
+    dedupeHits += other.dedupeHits;
+    lambdasUnwrapped += other.lambdasUnwrapped;
+    functorsUnwrapped += other.functorsUnwrapped;
+    for (auto &[depth, n] : other.functorDepths) {
+        functorDepths[depth] += n;
+    }
+    for (auto &[depth, n] : other.lambdaDepths) {
+        lambdaDepths[depth] += n;
+    }
+    for (auto &[kind, n] : other.errors) {
+        errors[kind] += n;
+    }
+    derivationsSkipped += other.derivationsSkipped;
+    systemCopiesSkipped += other.systemCopiesSkipped;
+    for (auto &[phase, time] : other.phases) {
+        phases[phase] = std::max(phases[phase], time);
+    }
+}
+
+static json histogramToJson(const std::map<size_t, uint64_t> &histogram) {
+    json j = json::object();
+    for (auto &[depth, n] : histogram) {
+        j[std::to_string(depth)] = n;
+    }
+    return j;
+}
+
+json RunStats::toJson() const {
+    json j = {{"nodes_visited", nodesVisited},
+              {"values_forced", valuesForced},
+              {"dedupe_hits", dedupeHits},
+              {"lambdas_unwrapped", lambdasUnwrapped},
+              {"functors_unwrapped", functorsUnwrapped},
+              {"lambda_depths", histogramToJson(lambdaDepths)},
+              {"functor_depths", histogramToJson(functorDepths)},
+              {"errors", errors},
+              {"derivations_skipped", derivationsSkipped},
+              {"system_copies_skipped", systemCopiesSkipped}};
+
+    // In seconds
+    j["phases"] = json::object();
+    for (auto &[phase, time] : phases) {
+        j["phases"][phase] = std::chrono::duration<double>(time).count();
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        // ru_maxrss is in KiB on Linux
+        j["peak_rss"] = uint64_t(usage.ru_maxrss) * 1024;
+    } else {
+        j["peak_rss"] = nullptr;
+    }
+
+#if HAVE_BOEHMGC
+    j["gc"] = {{"heap_size", *gcHeapSize()},
+               {"collections", uint64_t(GC_get_gc_no())}};
+#else
+    j["gc"] = nullptr;
+#endif
+    return j;
+}
+
+std::optional<uint64_t> gcHeapSize() {
+#if HAVE_BOEHMGC
+    return GC_get_heap_size();
+#else
+    return std::nullopt;
+#endif
+}
+
+void writeStats(const RunStats &stats, const std::string &file) {
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream out(tmp);
+        if (!out.is_open()) {
+            throw Error("cannot open statistics file '%s'", tmp);
+        }
+        out << stats.toJson().dump(2);
+    }
+    std::filesystem::rename(tmp, file);
+}
+
+std::string statsFileFor(const std::string &output) {
+    std::filesystem::path path(output);
+    return path.replace_extension(".stats.json").string();
+}
+
+}; // namespace flutsch
@@ -0,0 +1,111 @@
+#include <nix/error.hh>
+
+#include <filesystem>
+
+#include "watch.hh"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace flutsch {
+
+#ifdef __linux__
+
+// Changes closer together than this are reported as one batch.
+static const int settleMillis = 100;
+
+static const uint32_t watchMask =
+    IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+
+FileWatcher::FileWatcher() {
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1) {
+        throw nix::SysError("creating inotify instance");
+    }
+}
+
+FileWatcher::~FileWatcher() { close(fd); }
+
+void FileWatcher::watch(const std::set<std::string> &newFiles) {
+    for (auto &[wd, dir] : dirs) {
+        inotify_rm_watch(fd, wd);
+    }
+    dirs.clear();
+    files = newFiles;
+
+    std::set<std::string> parents;
+    for (auto &file : files) {
+        parents.insert(std::filesystem::path(file).parent_path().string());
+    }
+    for (auto &dir : parents) {
+        int wd = inotify_add_watch(fd, dir.c_str(), watchMask);
+        if (wd == -1) {
+            // The directory may be gone. Nothing to watch then.
+            continue;
+        }
+        dirs[wd] = dir;
+    }
+}
+
+std::set<std::string> FileWatcher::waitForChanges() {
+    std::set<std::string> changed;
+    alignas(struct inotify_event) char buf[64 * 1024];
+
+    while (true) {
+        if (!changed.empty()) {
+            struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+            int ready = poll(&pfd, 1, settleMillis);
+            if (ready == 0) {
+                return changed;
+            }
+            if (ready == -1) {
+                // Poll again rather than block in read() below.
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw nix::SysError("waiting for file changes");
+            }
+        }
+
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw nix::SysError("reading inotify events");
+        }
+
+        for (char *p = buf; p < buf + len;) {
+            auto *event = reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            auto dir = dirs.find(event->wd);
+            if (dir == dirs.end() || event->len == 0) {
+                continue;
+            }
+            std::string file = dir->second + "/" + event->name;
+            if (files.count(file)) {
+                changed.insert(file);
+            }
+        }
+    }
+}
+
+#else
+
+FileWatcher::FileWatcher() {
+    throw nix::Error("watching files is only supported on Linux");
+}
+
+FileWatcher::~FileWatcher() {}
+
+void FileWatcher::watch(const std::set<std::string> &) {}
+
+std::set<std::string> FileWatcher::waitForChanges() { return {}; }
+
+#endif
+
+}; // namespace flutsch
@@ -0,0 +1,10 @@
+{
+  # Curried, with formals in the middle
+  curried = a: { b, c ? 1, ... }: d: a;
+  # Ends in an attrset without __functor
+  withLet = x: let y = x; in with y; { inherit y; };
+  # Only known to return a function after evaluation
+  needsEval = x: builtins.id (y: y);
+  # Calling it fails, reading the syntax tree does not
+  guarded = x: assert x == 0; y: y;
+}
@@ -0,0 +1,5 @@
+# More attributes than a traversal introspects
+builtins.listToAttrs (builtins.genList (n: {
+  name = "a${toString n}";
+  value = n;
+}) 600)
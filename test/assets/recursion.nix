@@ -0,0 +1,4 @@
+{
+  loop = let f = x: f (x + 1); in f 0;
+  fine = 1;
+}
@@ -0,0 +1,7 @@
+{
+  # Same shape
+  first = { a = 1; b = "x"; };
+  second = { a = 2; b = "y"; };
+  # Another shape
+  other = { a = 1; };
+}
@@ -0,0 +1,17 @@
+let
+  perSystem = system: {
+    # The same definition on every system
+    shared = x: x;
+  };
+in
+{
+  packages = {
+    x86_64-linux = perSystem "x86_64-linux";
+    aarch64-darwin = perSystem "aarch64-darwin" // {
+      # Only defined for this system
+      darwinOnly = 1;
+    };
+    # Not a system, despite its name
+    util-linux = perSystem "util-linux";
+  };
+}
@@ -0,0 +1,16 @@
+let
+  # Only the type is looked at, so this needs no store
+  drv = {
+    type = "derivation";
+    name = "visited";
+  };
+in
+rec {
+  # Refers back to itself
+  cycle = { inner = cycle; };
+  fn = x: x;
+  inherit drv;
+  broken = throw "broken";
+  # Its children are skipped by the visitor
+  pruned = { hidden = 1; };
+}
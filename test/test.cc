@@ -4,13 +4,17 @@
 #include <cstddef>
 #include <map>
 #include <iostream>
+#include <limits>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <thread>
 #include <fstream>
 #include <filesystem>
 #include <regex>
+#include <sstream>
 #include <nix/eval-settings.hh>
 #include <nix/config.h>
 #include <nix/shared.hh>
@@ -43,7 +47,28 @@
 
 #include <catch2/catch_test_macros.hpp>
 #include "catch2/catch_all.hpp"
+#include <checkpoint.hh>
+#include <compression.hh>
+#include <deps.hh>
+#include <diff.hh>
+#include <errors.hh>
+#include <doc-comments.hh>
 #include <flutsch.hh>
+#include <flutsch-c.h>
+#include <isolate.hh>
+#include <json-writer.hh>
+#include <records.hh>
+#include <position-index.hh>
+#include <progress.hh>
+#include <result-buffer.hh>
+#include <search-index.hh>
+#include <shapes.hh>
+#include <shard.hh>
+#include <spsc-queue.hh>
+#include <stats.hh>
+#include <visitor.hh>
+#include <watch.hh>
+#include <work-queue.hh>
 #include <cstdlib>  // for getenv
 
 using namespace nix;
@@ -128,8 +153,907 @@ void init(std::string test_file, Func test_fn) {
     });
 }
 
+static void initNixOnce() {
+    static std::once_flag initialized;
+    std::call_once(initialized, []() {
+        initNix();
+        initGC();
+        settings.builders = "";
+        evalSettings.pureEval = false;
+    });
+}
+
+// All records of the output file 'file'.
+static std::vector<nlohmann::json> readAll(const std::string &file) {
+    std::vector<nlohmann::json> records;
+    flutsch::RecordReader reader(file);
+    while (auto record = reader.next()) {
+        records.push_back(std::move(*record));
+    }
+    return records;
+}
+
+// Run a complete introspection of the asset 'file', with 'configure'
+// applied to the config, and return the written records.
+static std::vector<nlohmann::json>
+analyzeAsset(const std::string &file,
+             const std::function<void(flutsch::Config &)> &configure = {}) {
+    initNixOnce();
+    flutsch::Config config{{}, getAssetPath(file)};
+    auto out = std::filesystem::temp_directory_path() / ("flutsch-" + file);
+    config.outFile = out.replace_extension(".ndjson").string();
+    config.format = "ndjson";
+    if (configure) {
+        configure(config);
+    }
+    flutsch::getPositions(args, config);
+    return readAll(config.outFile);
+}
+
+// The record of the attribute at 'path', below the root.
+static std::optional<nlohmann::json>
+recordAt(const std::vector<nlohmann::json> &records,
+         std::vector<std::string> path) {
+    path.insert(path.begin(), "<root>");
+    for (auto &record : records) {
+        if (record["value"]["path"] == path) {
+            return record;
+        }
+    }
+    return std::nullopt;
+}
+
 TEST_CASE("Create Analyzer", "simple.nix") {
     init(std::string("simple.nix"),[&](flutsch::Analyzer &test, std::string expected) {
         REQUIRE(expected == test.print_root_value());
     });
 }
+
+static int recurseForever(int depth) {
+    volatile char frame[256];
+    frame[0] = static_cast<char>(depth);
+    return recurseForever(depth + 1) + frame[0];
+}
+
+TEST_CASE("Stack overflow is isolated", "[isolate]") {
+    initGC();
+    flutsch::allowGcThreads();
+    auto result = flutsch::runOnLargeStack(
+        8 * 1024 * 1024, []() { recurseForever(0); });
+    REQUIRE(result == flutsch::IsolationResult::StackOverflow);
+
+    // The process is still usable afterwards
+    result = flutsch::runOnLargeStack(8 * 1024 * 1024, []() {});
+    REQUIRE(result == flutsch::IsolationResult::Completed);
+}
+
+TEST_CASE("Infinite recursion ends at max-call-depth", "recursion.nix") {
+    auto records = analyzeAsset("recursion.nix");
+    auto loop = recordAt(records, {"loop"});
+    REQUIRE(loop);
+    REQUIRE((*loop)["value"]["error"] == true);
+    REQUIRE((*loop)["value"]["type"] == "EvalError");
+    // The evaluator is still usable for the next attribute.
+    auto fine = recordAt(records, {"fine"});
+    REQUIRE(fine);
+    REQUIRE((*fine)["value"]["type"] == "int");
+}
+
+TEST_CASE("SPSC queue hands over everything in order", "[spsc-queue]") {
+    flutsch::SpscQueue<int> queue(16);
+    std::vector<int> received;
+
+    std::thread consumer([&]() {
+        while (auto item = queue.pop()) {
+            received.push_back(*item);
+        }
+    });
+    for (int i = 0; i < 10000; i++) {
+        queue.push(i);
+    }
+    queue.close();
+    consumer.join();
+
+    REQUIRE(received.size() == 10000);
+    for (int i = 0; i < 10000; i++) {
+        REQUIRE(received[i] == i);
+    }
+}
+
+TEST_CASE("Workers take their own jobs first and steal the last",
+          "[work-queue]") {
+    flutsch::WorkStealingQueue<int> queue(2);
+    for (int i = 0; i < 6; i++) {
+        queue.push(i);
+    }
+    // Worker 0 was dealt 0, 2 and 4, worker 1 was dealt 1, 3 and 5.
+    REQUIRE(queue.pop(0) == 0);
+    REQUIRE(queue.pop(0) == 2);
+    REQUIRE(queue.pop(0) == 4);
+    REQUIRE(queue.pop(0) == 5);
+    REQUIRE(queue.pop(1) == 1);
+    REQUIRE(queue.pop(1) == 3);
+    REQUIRE(queue.pop(0) == std::nullopt);
+    REQUIRE(queue.pop(1) == std::nullopt);
+}
+
+TEST_CASE("Every job is taken exactly once", "[work-queue]") {
+    const int jobs = 10000;
+    const size_t workers = 4;
+    flutsch::WorkStealingQueue<int> queue(workers);
+    for (int i = 0; i < jobs; i++) {
+        queue.push(i);
+    }
+    std::vector<std::vector<int>> taken(workers);
+    std::vector<std::thread> threads;
+    for (size_t n = 0; n < workers; n++) {
+        threads.emplace_back([&, n]() {
+            while (auto job = queue.pop(n)) {
+                taken[n].push_back(*job);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<int> all;
+    for (auto &own : taken) {
+        all.insert(all.end(), own.begin(), own.end());
+    }
+    std::sort(all.begin(), all.end());
+    REQUIRE(all.size() == size_t(jobs));
+    for (int i = 0; i < jobs; i++) {
+        REQUIRE(all[i] == i);
+    }
+}
+
+TEST_CASE("Sampling keeps both ends and strides the middle", "[sample]") {
+    flutsch::Config config{{}, ""};
+    REQUIRE(flutsch::sampleIndices(100, config).size() == 100);
+
+    config.sampleThreshold = 50;
+    config.sampleSize = 8;
+    REQUIRE(flutsch::sampleIndices(50, config).size() == 50);
+
+    auto indices = flutsch::sampleIndices(100, config);
+    REQUIRE(indices == std::vector<size_t>({0, 1, 2, 26, 50, 74, 98, 99}));
+}
+
+TEST_CASE("Equal shapes are interned once", "[shapes]") {
+    flutsch::ShapeTable table;
+    auto intShape = table.intern({"int"});
+    auto meta = table.intern({"attrset", {{"a", intShape}, {"b", intShape}}});
+    REQUIRE(table.intern({"int"}) == intShape);
+    REQUIRE(table.intern({"attrset", {{"a", intShape}, {"b", intShape}}}) ==
+            meta);
+    REQUIRE(table.intern({"attrset", {{"a", intShape}}}) != meta);
+    REQUIRE(table.size() == 3);
+}
+
+// Stats-only policy, only implements the hooks it needs.
+struct CountingVisitor {
+    size_t attrsets = 0;
+    size_t values = 0;
+
+    void on_attrset(const flutsch::AttrsetView &) { attrsets++; }
+    void on_value(const flutsch::ValueView &view) {
+        REQUIRE(view.path == std::vector<std::string>({"a"}));
+        values++;
+    }
+};
+
+TEST_CASE("Visitors see every node", "simple.nix") {
+    init(std::string("simple.nix"),
+         [&](flutsch::Analyzer &test, std::string expected) {
+             CountingVisitor visitor;
+             test.visit(visitor);
+             REQUIRE(visitor.attrsets == 1);
+             REQUIRE(visitor.values == 1);
+         });
+}
+
+// Records the joined path of every node it sees, per hook.
+struct RecordingVisitor {
+    std::vector<std::string> attrsets, lambdas, derivations, errors, values,
+        repeats;
+
+    static std::string join(const flutsch::NodeView &view) {
+        std::string result;
+        for (auto &name : view.path) {
+            result += (result.empty() ? "" : ".") + name;
+        }
+        return result;
+    }
+
+    bool on_attrset(const flutsch::AttrsetView &view) {
+        attrsets.push_back(join(view));
+        return join(view) != "pruned";
+    }
+    void on_lambda(const flutsch::LambdaView &view) {
+        lambdas.push_back(join(view));
+    }
+    void on_derivation(const flutsch::DerivationView &view) {
+        derivations.push_back(join(view));
+    }
+    void on_error(const flutsch::ErrorView &view) {
+        errors.push_back(join(view));
+    }
+    void on_value(const flutsch::ValueView &view) {
+        values.push_back(join(view));
+    }
+    void on_repeat(const flutsch::RepeatView &view) {
+        repeats.push_back(join(view));
+    }
+};
+
+TEST_CASE("Visitors see each kind of node once", "visitor.nix") {
+    initNixOnce();
+    flutsch::Config config{{}, getAssetPath("visitor.nix")};
+    flutsch::Analyzer analyzer(args, config);
+    analyzer.init_root_value();
+    RecordingVisitor visitor;
+    REQUIRE(analyzer.visit(visitor));
+
+    using Paths = std::vector<std::string>;
+    REQUIRE(visitor.attrsets == Paths{"", "cycle", "pruned"});
+    REQUIRE(visitor.lambdas == Paths{"fn"});
+    REQUIRE(visitor.derivations == Paths{"drv"});
+    REQUIRE(visitor.errors == Paths{"broken"});
+    // "pruned.hidden" is skipped.
+    REQUIRE(visitor.values.empty());
+    // The cycle is reported, but not followed.
+    REQUIRE(visitor.repeats == Paths{"cycle.inner"});
+}
+
+TEST_CASE("Visitors stop at maxEntries", "many.nix") {
+    initNixOnce();
+    flutsch::Config config{{}, getAssetPath("many.nix")};
+    flutsch::Analyzer analyzer(args, config);
+    analyzer.init_root_value();
+    RecordingVisitor visitor;
+    REQUIRE(!analyzer.visit(visitor));
+    // The root and the first attributes
+    REQUIRE(visitor.values.size() == flutsch::maxEntries - 1);
+}
+
+TEST_CASE("Result buffer holds nodes and strings", "simple.nix") {
+    init(std::string("simple.nix"),
+         [&](flutsch::Analyzer &test, std::string expected) {
+             auto buffer = flutsch::buildResultBuffer(test);
+             const void *data = buffer.data();
+             REQUIRE(std::string(static_cast<const char *>(data)) ==
+                     FLUTSCH_BUFFER_MAGIC);
+             REQUIRE(flutsch_node_count(data) == 2);
+
+             auto root = flutsch_node_at(data, 0);
+             REQUIRE(root->parent == FLUTSCH_NONE);
+             REQUIRE(root->kind == FLUTSCH_NODE_ATTRSET);
+
+             auto a = flutsch_node_at(data, 1);
+             REQUIRE(a->parent == 0);
+             REQUIRE(std::string(flutsch_string(data, a->name)) == "a");
+             REQUIRE(std::string(flutsch_string(data, a->type)) == "int");
+             REQUIRE(a->binding_pos.line == 2);
+         });
+}
+
+TEST_CASE("The C API runs an analyzer", "[c-api]") {
+    REQUIRE(flutsch_analyzer_new(nullptr, 0) == nullptr);
+
+    auto *analyzer =
+        flutsch_analyzer_new(getAssetPath("visitor.nix").c_str(), 0);
+    REQUIRE(analyzer != nullptr);
+    REQUIRE(flutsch_analyzer_buffer(analyzer, nullptr) == nullptr);
+    REQUIRE(flutsch_analyzer_run(analyzer) == 0);
+    REQUIRE(flutsch_analyzer_error(analyzer) == nullptr);
+
+    size_t size = 0;
+    const void *data = flutsch_analyzer_buffer(analyzer, &size);
+    REQUIRE(data != nullptr);
+    REQUIRE(size > sizeof(flutsch_buffer_header));
+    std::vector<std::string> repeats;
+    for (uint32_t n = 0; n < flutsch_node_count(data); n++) {
+        auto node = flutsch_node_at(data, n);
+        if (node->kind == FLUTSCH_NODE_REPEAT) {
+            repeats.push_back(flutsch_string(data, node->name));
+        }
+    }
+    REQUIRE(repeats == std::vector<std::string>{"inner"});
+    flutsch_analyzer_free(analyzer);
+
+    // A failed run has a message and no buffer.
+    analyzer = flutsch_analyzer_new(getAssetPath("missing.nix").c_str(), 0);
+    REQUIRE(flutsch_analyzer_run(analyzer) == 1);
+    REQUIRE(flutsch_analyzer_error(analyzer) != nullptr);
+    REQUIRE(flutsch_analyzer_buffer(analyzer, &size) == nullptr);
+    REQUIRE(size == 0);
+    flutsch_analyzer_free(analyzer);
+}
+
+TEST_CASE("Doc comments directly in front are found", "[doc-comments]") {
+    std::string source = "{\n"
+                         "  /** Adds one\n"
+                         "      to x */\n"
+                         "  inc = x: x + 1;\n"
+                         "  # Line\n"
+                         "  #   comment\n"
+                         "  dec = x: x - 1;\n"
+                         "  x = 1; # trailing\n"
+                         "  y = 2;\n"
+                         "}\n";
+    auto before = [&](const std::string &binding) {
+        return flutsch::docCommentBefore(source, source.find(binding));
+    };
+    REQUIRE(before("inc") == "Adds one\nto x");
+    REQUIRE(before("dec") == "Line\n  comment");
+    REQUIRE(before("y =") == std::nullopt);
+}
+
+TEST_CASE("Records are read one at a time", "[records]") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto arrayFile = (dir / "flutsch-records.json").string();
+    auto linesFile = (dir / "flutsch-records.ndjson").string();
+    std::ofstream(arrayFile)
+        << "[\n    {\"a\": \"}]\"},\n    {\"b\": [1]}\n]\n";
+    std::ofstream(linesFile) << "{\"a\": \"}]\"}\n{\"b\": [1]}\n";
+
+    for (auto &file : {arrayFile, linesFile}) {
+        flutsch::RecordReader reader(file);
+        REQUIRE(reader.next() == nlohmann::json({{"a", "}]"}}));
+        REQUIRE(reader.next() ==
+                nlohmann::json({{"b", nlohmann::json::array({1})}}));
+        REQUIRE(reader.next() == std::nullopt);
+    }
+}
+
+TEST_CASE("Search finds names and formals by substring", "[search]") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto output = (dir / "flutsch-search.ndjson").string();
+    std::ofstream(output)
+        << "{\"value\": {\"path\": [\"<root>\"], \"lambda\": null}}\n"
+           "{\"value\": {\"path\": [\"<root>\", \"lib\", \"concatMap\"], "
+           "\"lambda\": {\"0\": {\"formals\": [{\"name\": \"mapper\"}]}}}}\n"
+           "{\"value\": {\"path\": [\"<root>\", \"map\"], \"lambda\": null}}\n";
+    auto indexFile = flutsch::searchIndexFileFor(output);
+    flutsch::writeSearchIndex(output, indexFile);
+
+    flutsch::SearchIndex index(indexFile);
+    auto hits = index.find("MAP", 10);
+    REQUIRE(hits.size() == 3);
+    // Exact before prefix before substring matches
+    REQUIRE(hits[0].path == "map");
+    REQUIRE(hits[1].path == "lib.concatMap");
+    REQUIRE(hits[1].formal);
+    REQUIRE(hits[2].name == "concatMap");
+    REQUIRE(index.find("xyz", 10).empty());
+}
+
+TEST_CASE("Positions resolve to the definitions there", "[positions]") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto output = (dir / "flutsch-positions.ndjson").string();
+    std::ofstream(output) << R"({"binding": {"pos": {"file": "/a.nix", "line": 2, "column": 3}},
+ "value": {"path": ["<root>", "f"], "lambda": {"0": {
+  "pos": {"file": "/a.nix", "line": 2, "column": 7},
+  "formals": [{"name": "x", "pos": {"file": "/a.nix", "line": 2, "column": 9}}]}}}}
+{"binding": {"pos": {"file": "/a.nix", "line": 5, "column": 3}},
+ "value": {"path": ["<root>", "g"], "lambda": null}}
+)";
+    auto indexFile = flutsch::positionIndexFileFor(output);
+    flutsch::writePositionIndex(output, indexFile);
+
+    flutsch::PositionIndex index(indexFile);
+    auto hits = index.at("/a.nix", 2);
+    REQUIRE(hits.size() == 3);
+    REQUIRE(hits[0].kind == "binding");
+    REQUIRE(hits[2].kind == "formal");
+    REQUIRE(hits[2].name == "x");
+
+    // Nothing starts on line 4, it belongs to the closest definition before.
+    hits = index.at("/a.nix", 4);
+    REQUIRE(hits.size() == 1);
+    REQUIRE(hits[0].name == "x");
+
+    REQUIRE(index.at("/a.nix", 5)[0].path == "g");
+    REQUIRE(index.at("/b.nix", 2).empty());
+}
+
+TEST_CASE("Statistics of workers add up", "[stats]") {
+    flutsch::RunStats a;
+    a.nodesVisited = 3;
+    a.errors["Throw"] = 1;
+    a.addUnwrap(2, true);
+    a.phases["traversal"] = std::chrono::seconds(2);
+
+    flutsch::RunStats b;
+    b.nodesVisited = 4;
+    b.errors["Throw"] = 2;
+    b.addUnwrap(2, true);
+    b.addUnwrap(1, false);
+    b.phases["traversal"] = std::chrono::seconds(3);
+
+    a.merge(b);
+    auto j = a.toJson();
+    REQUIRE(j["nodes_visited"] == 7);
+    REQUIRE(j["errors"]["Throw"] == 3);
+    REQUIRE(j["functor_depths"]["2"] == 2);
+    REQUIRE(j["lambdas_unwrapped"] == 1);
+    // The workers ran concurrently
+    REQUIRE(j["phases"]["traversal"] == 3.0);
+    REQUIRE(j["peak_rss"] > 0);
+}
+
+TEST_CASE("Progress publishes the path only on request", "[progress]") {
+    flutsch::Progress progress;
+    progress.discover(2);
+    progress.take();
+    progress.visit();
+    REQUIRE(progress.wantsPath());
+    progress.setPath("a.b");
+    REQUIRE(!progress.wantsPath());
+
+    auto snapshot = progress.snapshot();
+    REQUIRE(snapshot.visited == 1);
+    REQUIRE(snapshot.frontier == 1);
+    REQUIRE(snapshot.path == "a.b");
+    REQUIRE(progress.wantsPath());
+}
+
+TEST_CASE("The last report tells a failed run from a finished one",
+          "[progress]") {
+    // Not a terminal under ctest, so every report is a JSON line.
+    const auto lastReport = [](bool finish) {
+        std::ostringstream captured;
+        auto *previous = std::cerr.rdbuf(captured.rdbuf());
+        {
+            flutsch::Progress progress;
+            flutsch::ProgressReporter reporter(progress);
+            if (finish) {
+                reporter.finish();
+            }
+        }
+        std::cerr.rdbuf(previous);
+        auto text = captured.str();
+        text.pop_back();
+        return nlohmann::json::parse(text.substr(text.rfind('\n') + 1));
+    };
+
+    auto finished = lastReport(true);
+    REQUIRE(finished["done"] == true);
+    REQUIRE(finished["failed"] == false);
+    auto failed = lastReport(false);
+    REQUIRE(failed["done"] == false);
+    REQUIRE(failed["failed"] == true);
+}
+
+TEST_CASE("Checkpoints resume with the committed records", "[checkpoint]") {
+    auto dir = (std::filesystem::temp_directory_path() / "flutsch-checkpoint")
+                   .string();
+    std::filesystem::remove_all(dir);
+
+    {
+        flutsch::CheckpointWriter writer(dir, flutsch::Checkpoint{"expr"});
+        writer.add(R"({"n": 1})");
+        writer.add(R"({"n": 2})");
+        writer.commit({"a"});
+        // Not committed, e.g. the run was killed before the next commit.
+        writer.add(R"({"n": 3})");
+    }
+
+    auto checkpoint = flutsch::readCheckpoint(dir);
+    REQUIRE(checkpoint);
+    REQUIRE(checkpoint->releaseExpr == "expr");
+    REQUIRE(checkpoint->done == std::set<std::string>{"a"});
+    REQUIRE(checkpoint->records.size() == 2);
+    REQUIRE(checkpoint->records[1]["n"] == 2);
+
+    {
+        flutsch::CheckpointWriter writer(dir, *checkpoint);
+        writer.add(R"({"n": 4})");
+        writer.commit({"a", "b"});
+    }
+
+    checkpoint = flutsch::readCheckpoint(dir);
+    REQUIRE(checkpoint->done.size() == 2);
+    REQUIRE(checkpoint->records.size() == 3);
+    REQUIRE(checkpoint->records[2]["n"] == 4);
+    // Only the records of the latest generation are kept.
+    size_t recordFiles = 0;
+    for (auto &entry : std::filesystem::directory_iterator(dir)) {
+        recordFiles += entry.path().filename().string().starts_with("records-");
+    }
+    REQUIRE(recordFiles == 1);
+    REQUIRE(!flutsch::readCheckpoint(dir + "-missing"));
+}
+
+TEST_CASE("Dependencies detect changed files", "[deps]") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto a = (dir / "flutsch-deps-a.nix").string();
+    auto b = (dir / "flutsch-deps-b.nix").string();
+    std::ofstream(a) << "1";
+    std::ofstream(b) << "2";
+
+    REQUIRE(flutsch::fileFingerprint(a) != flutsch::fileFingerprint(b));
+    REQUIRE(flutsch::fileFingerprint((dir / "flutsch-missing").string()) ==
+            "");
+
+    flutsch::DependencyInfo info{"expr"};
+    info.root = {a};
+    info.attrs = {{"x", {a}}, {"y", {b}}};
+    info.order = {"x", "y"};
+    info.fingerprints = {{a, flutsch::fileFingerprint(a)},
+                         {b, flutsch::fileFingerprint(b)}};
+    REQUIRE(flutsch::changedFiles(info).empty());
+
+    auto file = (dir / "flutsch-deps.json").string();
+    flutsch::writeDependencies(file, info);
+    auto read = flutsch::readDependencies(file);
+    REQUIRE(read.releaseExpr == "expr");
+    REQUIRE(read.root == info.root);
+    REQUIRE(read.attrs == info.attrs);
+    REQUIRE(read.order == info.order);
+    REQUIRE(read.fingerprints == info.fingerprints);
+
+    std::ofstream(b) << "22";
+    REQUIRE(flutsch::changedFiles(read) == std::set<std::string>{b});
+}
+
+TEST_CASE("Attributes after a changed one are not reused", "[deps]") {
+    flutsch::DependencyInfo info;
+    info.attrs = {{"a", {"/lib.nix", "/a.nix"}},
+                  {"b", {"/b.nix"}},
+                  {"c", {"/c.nix"}}};
+    info.order = {"a", "b", "c"};
+
+    // 'c' may use values of 'b' that were forced while 'b' was introspected.
+    REQUIRE(flutsch::reusableAttrs(info, {"/b.nix"}) ==
+            std::set<std::string>{"a"});
+    REQUIRE(flutsch::reusableAttrs(info, {"/c.nix"}) ==
+            std::set<std::string>{"a", "b"});
+    REQUIRE(flutsch::reusableAttrs(info, {"/lib.nix"}).empty());
+    REQUIRE(flutsch::reusableAttrs(info, {}).size() == 3);
+}
+
+#ifdef __linux__
+TEST_CASE("Watched files report changes", "[watch]") {
+    auto dir = std::filesystem::temp_directory_path() / "flutsch-watch";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    auto watched = (dir / "watched.nix").string();
+    auto other = (dir / "other.nix").string();
+    std::ofstream(watched) << "1";
+
+    flutsch::FileWatcher watcher;
+    watcher.watch({watched});
+    std::thread writer([&]() {
+        std::ofstream(other) << "2";
+        // Editors often save to a temporary file and rename it.
+        std::ofstream(watched + ".tmp") << "3";
+        std::filesystem::rename(watched + ".tmp", watched);
+    });
+    auto changed = watcher.waitForChanges();
+    writer.join();
+    REQUIRE(changed == std::set<std::string>{watched});
+}
+#endif
+
+TEST_CASE("JsonWriter output matches nlohmann", "[json]") {
+    std::string control;
+    for (char c = 0; c < 0x20; c++) {
+        control.push_back(c);
+    }
+    std::vector<std::string> strings = {
+        "",
+        "plain",
+        "\"quoted\" and \\backslash\\",
+        "ümlaut, 日本語 and 🙂",
+        control,
+        // Longer than a vector register, special characters at the edges
+        "0123456789abcdef\"0123456789abcde\n",
+        "a very long string without anything that needs to be escaped",
+        std::string("nul\0inside", 10),
+    };
+    std::vector<double> doubles = {0.0,  -0.0,    1.0,   0.1,   -2.5,
+                                   1e100, 1.5e-7, 1e21, 123456.789,
+                                   std::numeric_limits<double>::quiet_NaN()};
+
+    nlohmann::json expected = nlohmann::json::array();
+    flutsch::StringSink sink;
+    {
+        flutsch::JsonWriter out(sink);
+        out.beginArray();
+        for (auto &s : strings) {
+            out.string(s);
+            expected.push_back(s);
+        }
+        for (auto d : doubles) {
+            out.number(d);
+            expected.push_back(d);
+        }
+        out.number(uint64_t(18446744073709551615ULL));
+        expected.push_back(uint64_t(18446744073709551615ULL));
+        out.number(int64_t(-9223372036854775807LL));
+        expected.push_back(int64_t(-9223372036854775807LL));
+        out.beginObject();
+        out.key("k\"ey");
+        out.null();
+        out.endObject();
+        expected.push_back({{"k\"ey", nullptr}});
+        out.endArray();
+    }
+    REQUIRE(sink.data == expected.dump(4));
+}
+
+TEST_CASE("Compressed NDJSON records round-trip", "[records]") {
+    if (!flutsch::haveZstd()) {
+        SKIP("built without zstd");
+    }
+    auto file =
+        (std::filesystem::temp_directory_path() / "flutsch-records.ndjson.zst")
+            .string();
+    std::vector<nlohmann::json> written;
+    {
+        auto sink = std::make_unique<flutsch::ZstdSink>(
+            std::make_unique<flutsch::FileSink>(file), 3, 0);
+        flutsch::JsonWriter out(*sink, 0);
+        // More than one read buffer of the reader
+        for (size_t n = 0; n < 50000; n++) {
+            nlohmann::json record = {
+                {"value", {{"path", {"<root>", "attr" + std::to_string(n)}},
+                           {"error_description", "line\n\"quoted\""}}}};
+            flutsch::writeJsonValue(out, record);
+            out.lineBreak();
+            written.push_back(record);
+        }
+        out.flush();
+        sink->finish();
+    }
+
+    flutsch::RecordReader reader(file);
+    for (auto &record : written) {
+        REQUIRE(reader.next() == record);
+    }
+    REQUIRE(reader.next() == std::nullopt);
+    REQUIRE(flutsch::readRecords(file).size() == written.size());
+}
+
+TEST_CASE("Lambdas are unwrapped from the syntax tree", "lambdas.nix") {
+    auto applied = analyzeAsset("lambdas.nix");
+    auto parsed = analyzeAsset("lambdas.nix", [](flutsch::Config &config) {
+        config.staticLambdas = true;
+    });
+    const auto lambdaOf = [](const std::vector<nlohmann::json> &records,
+                             const std::string &name) {
+        auto record = recordAt(records, {name});
+        REQUIRE(record);
+        return (*record)["value"]["lambda"];
+    };
+
+    auto curried = lambdaOf(parsed, "curried");
+    REQUIRE(curried.size() == 3);
+    REQUIRE(curried["0"]["arg"] == "a");
+    auto &formals = curried["1"]["formals"];
+    REQUIRE(formals.size() == 3);
+    REQUIRE(formals[0]["name"] == "b");
+    REQUIRE(formals[0]["required"] == true);
+    REQUIRE(formals[1]["required"] == false);
+    REQUIRE(formals[2]["name"] == "...");
+    REQUIRE(curried["2"]["arg"] == "d");
+
+    // Whenever the syntax tree is conclusive, so is applying the function.
+    for (auto name : {"curried", "withLet", "needsEval"}) {
+        REQUIRE(lambdaOf(parsed, name) == lambdaOf(applied, name));
+    }
+    REQUIRE(lambdaOf(parsed, "withLet").size() == 1);
+    // Falls back to applying the function.
+    REQUIRE(lambdaOf(parsed, "needsEval").size() == 2);
+    // The assertion is never evaluated.
+    REQUIRE(lambdaOf(parsed, "guarded").size() == 2);
+}
+
+TEST_CASE("Errors are classified by their most specific type", "[errors]") {
+    nix::ThrownError thrown("boom");
+    auto &kind = flutsch::classifyError(thrown);
+    REQUIRE(kind.name == "Throw");
+    REQUIRE(flutsch::errorMessage(thrown, kind) == "boom");
+    // Classified once per type
+    REQUIRE(&flutsch::classifyError(nix::ThrownError("other")) == &kind);
+
+    // ThrownError derives from AssertionError, which derives from EvalError.
+    nix::AssertionError assertion("assertion failed");
+    auto &assertionKind = flutsch::classifyError(assertion);
+    REQUIRE(assertionKind.name == "AssertionError");
+    REQUIRE(!flutsch::errorMessage(assertion, assertionKind));
+    REQUIRE(flutsch::classifyError(nix::TypeError("x")).name == "TypeError");
+    REQUIRE(flutsch::classifyError(nix::EvalError("x")).name == "EvalError");
+    REQUIRE(flutsch::classifyError(nix::Error("x")).name == "Error");
+
+    nix::RestrictedPathError restricted("access to '/secret' is not allowed");
+    auto &restrictedKind = flutsch::classifyError(restricted);
+    REQUIRE(restrictedKind.name == "RestrictedPathError");
+    auto message = flutsch::errorMessage(restricted, restrictedKind);
+    REQUIRE(message);
+    REQUIRE(message->find("is not allowed") != std::string::npos);
+}
+
+TEST_CASE("Definitions shared by all systems are written once", "systems.nix") {
+    auto records = analyzeAsset("systems.nix", [](flutsch::Config &config) {
+        config.dedupeSystems = true;
+        config.canonicalSystem = "x86_64-linux";
+    });
+    REQUIRE(recordAt(records, {"packages", "x86_64-linux", "shared"}));
+    REQUIRE(recordAt(records, {"packages", "aarch64-darwin"}));
+    REQUIRE(!recordAt(records, {"packages", "aarch64-darwin", "shared"}));
+    REQUIRE(recordAt(records, {"packages", "aarch64-darwin", "darwinOnly"}));
+    REQUIRE(recordAt(records, {"packages", "util-linux", "shared"}));
+}
+
+TEST_CASE("Shards split attribute paths stably", "[shard]") {
+    // FNV-1a offset basis, nothing hashed
+    REQUIRE(flutsch::stableHash({}) == 0xcbf29ce484222325ULL);
+    REQUIRE(flutsch::stableHash({"hello"}) == flutsch::stableHash({"hello"}));
+    REQUIRE(flutsch::stableHash({"ab", "c"}) !=
+            flutsch::stableHash({"a", "bc"}));
+
+    flutsch::Config config{{}, ""};
+    REQUIRE(flutsch::inShard({"anything"}, config));
+    config.shardCount = 3;
+    for (auto name : {"hello", "python3Packages", "[2]"}) {
+        size_t shards = 0;
+        for (config.shardIndex = 0; config.shardIndex < 3;
+             config.shardIndex++) {
+            shards += flutsch::inShard({"pkgs", name}, config);
+        }
+        REQUIRE(shards == 1);
+    }
+}
+
+TEST_CASE("Merging shards writes shared records once", "[shard]") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto first = (dir / "flutsch-shard-1.ndjson").string();
+    auto second = (dir / "flutsch-shard-2.ndjson").string();
+    std::ofstream(first)
+        << R"({"binding": {"pos": null}, "value": {"path": ["<root>"]}})" "\n"
+           R"({"binding": {"pos": {"line": 1}}, "value": {"path": ["<root>", "a"]}})" "\n";
+    std::ofstream(second)
+        << R"({"binding": {"pos": null}, "value": {"path": ["<root>"]}})" "\n"
+           R"({"binding": {"pos": {"line": 2}}, "value": {"path": ["<root>", "b"]}})" "\n"
+           // Same path, but bound elsewhere
+           R"({"binding": {"pos": {"line": 3}}, "value": {"path": ["<root>", "a"]}})" "\n";
+
+    flutsch::Config config{{}, ""};
+    config.outFile = (dir / "flutsch-merged.ndjson").string();
+    config.format = "ndjson";
+    flutsch::mergeOutputs({first, second}, config);
+
+    auto merged = flutsch::readRecords(config.outFile);
+    REQUIRE(merged.size() == 4);
+    REQUIRE(merged[0]["value"]["path"].size() == 1);
+    REQUIRE(merged[2]["value"]["path"][1] == "b");
+}
+
+TEST_CASE("Diffs report added, removed and changed records", "[diff]") {
+    auto dir = std::filesystem::temp_directory_path();
+    auto before = (dir / "flutsch-diff-old.ndjson").string();
+    auto after = (dir / "flutsch-diff-new.ndjson").string();
+    std::ofstream(before)
+        << R"({"binding": {}, "value": {"path": ["<root>"], "children": [{"name": "a"}, {"name": "b"}]}})" "\n"
+           R"({"binding": {}, "value": {"path": ["<root>", "a"], "type": "int", "shape": 1}})" "\n"
+           R"({"binding": {}, "value": {"path": ["<root>", "b"], "type": "int"}})" "\n";
+    std::ofstream(after)
+        // Children in another order are not a change
+        << R"({"binding": {}, "value": {"path": ["<root>"], "children": [{"name": "b"}, {"name": "a"}]}})" "\n"
+           R"({"binding": {}, "value": {"path": ["<root>", "a"], "type": "string", "shape": 7}})" "\n"
+           R"({"binding": {}, "value": {"path": ["<root>", "c"], "type": "int"}})" "\n";
+
+    flutsch::Config config{{}, ""};
+    config.outFile = (dir / "flutsch-diff.ndjson").string();
+    config.format = "ndjson";
+    auto summary = flutsch::diffOutputs(before, after, config);
+    REQUIRE(summary.added == 1);
+    REQUIRE(summary.removed == 1);
+    REQUIRE(summary.changed == 1);
+
+    auto changes = readAll(config.outFile);
+    REQUIRE(changes.size() == 3);
+    REQUIRE(changes[0]["change"] == "changed");
+    REQUIRE(changes[0]["path"] == nlohmann::json({"<root>", "a"}));
+    // The shape ids differ, but they are not compared.
+    REQUIRE(changes[0]["fields"].size() == 1);
+    REQUIRE(changes[0]["fields"].contains("value.type"));
+    REQUIRE(changes[1]["change"] == "removed");
+    REQUIRE(changes[1]["path"] == nlohmann::json({"<root>", "b"}));
+    REQUIRE(changes[2]["change"] == "added");
+    REQUIRE(changes[2]["path"] == nlohmann::json({"<root>", "c"}));
+
+    // Records out of order
+
+    std::ofstream(after)
+        << R"({"binding": {}, "value": {"path": ["<root>", "c"]}})" "\n"
+           R"({"binding": {}, "value": {"path": ["<root>", "a"]}})" "\n";
+    REQUIRE_THROWS_AS(flutsch::diffOutputs(before, after, config),
+                      nix::Error);
+}
+
+TEST_CASE("Attrsets of the same shape share a shape id", "shapes.nix") {
+    std::string outFile;
+    auto records = analyzeAsset("shapes.nix", [&](flutsch::Config &config) {
+        config.shapes = true;
+        outFile = config.outFile;
+    });
+    const auto shapeAt = [&](const std::string &name) {
+        auto record = recordAt(records, {name});
+        REQUIRE(record);
+        REQUIRE((*record)["value"].contains("shape"));
+        return (*record)["value"]["shape"].get<uint64_t>();
+    };
+    REQUIRE(shapeAt("first") == shapeAt("second"));
+    REQUIRE(shapeAt("first") != shapeAt("other"));
+
+    std::ifstream file(flutsch::shapeFileFor(outFile));
+    auto shapes = nlohmann::json::parse(file);
+    auto &first = shapes.at(shapeAt("first"));
+    REQUIRE(first["id"] == shapeAt("first"));
+    REQUIRE(first["type"] == "attrset");
+    REQUIRE(first["fields"].size() == 2);
+    REQUIRE(shapes.at(first["fields"]["a"].get<uint64_t>())["type"] == "int");
+    REQUIRE(shapes.at(first["fields"]["b"].get<uint64_t>())["type"] ==
+            "string");
+    auto &other = shapes.at(shapeAt("other"));
+    REQUIRE(other["fields"]["a"] == first["fields"]["a"]);
+}
+
+TEST_CASE("Passes in one process write the same output", "simple.nix") {
+    auto first = analyzeAsset("simple.nix");
+    auto second = analyzeAsset("simple.nix");
+    REQUIRE(!first.empty());
+    REQUIRE(first == second);
+}
+
+TEST_CASE("Workers write the same paths as a single pass", "simple.nix") {
+    const auto paths = [](const std::vector<nlohmann::json> &records) {
+        std::vector<nlohmann::json> result;
+        for (auto &record : records) {
+            result.push_back(record["value"]["path"]);
+        }
+        return result;
+    };
+    auto single = paths(analyzeAsset("simple.nix"));
+    std::sort(single.begin(), single.end());
+    auto parallel =
+        paths(analyzeAsset("simple.nix", [](flutsch::Config &config) {
+            config.nrWorkers = 2;
+            config.sorted = true;
+        }));
+    // The root once, even though every worker evaluates it.
+    REQUIRE(parallel == single);
+}
+
+TEST_CASE("Batch jobs run one after another", "[batch]") {
+    initNixOnce();
+    auto dir = std::filesystem::temp_directory_path();
+    auto out = (dir / "flutsch-batch-1.ndjson").string();
+    nlohmann::json first = {{"expr", getAssetPath("simple.nix")},
+                            {"out", out}};
+    nlohmann::json failing = {
+        {"expr", getAssetPath("missing.nix")},
+        {"out", (dir / "flutsch-batch-2.ndjson").string()}};
+    // Without "out"
+    nlohmann::json last = {{"expr", getAssetPath("recursion.nix")}};
+    std::istringstream jobs(first.dump() + "\n\n" + failing.dump() + "\n" +
+                            last.dump() + "\n");
+
+    flutsch::Config config{{}, ""};
+    config.batch = true;
+    config.format = "ndjson";
+    auto previous = std::cin.rdbuf(jobs.rdbuf());
+    // A failed job does not stop the others.
+    REQUIRE_THROWS_WITH(flutsch::getPositions(args, config),
+                        Catch::Matchers::ContainsSubstring(
+                            "1 of 3 batch jobs failed"));
+    std::cin.rdbuf(previous);
+
+    REQUIRE(readAll(out) == analyzeAsset("simple.nix"));
+    REQUIRE(std::filesystem::exists("values-3.ndjson"));
+    std::filesystem::remove("values-3.ndjson");
+}